@@ -10,13 +10,51 @@ BEGIN_AUTOTEXGEN_NAMESPACE
 // Implementation details:
 // [Lloyd's Algorithm](https://en.wikipedia.org/wiki/Lloyd%27s_algorithm)
 // uses [kmeans++](https://en.wikipedia.org/wiki/K-means%2B%2B)
-// for initialization.
+// for initialization, with a fixed random seed so results are reproducible.
+//
+// Iterates until no mean moves further than _tolerance, or _maxIterations
+// passes have been run. The sums are reduced in a fixed order, so the same
+// data always gives the same clustering.
 //
 // @return A pair of two vectors,
 // first: a list of means, second: a list of indices that map an input to a mean
 
 std::pair<std::vector<fpreal3>, std::vector<uinteger>>
-kmeans_lloyd(const span<fpreal3> _data, uinteger _k);
+kmeans_lloyd(const span<fpreal3> _data,
+             uinteger _k,
+             uinteger _maxIterations = 100u,
+             fpreal _tolerance       = 1e-5_f);
+
+// Equivalent to kmeans_lloyd up to floating point rounding, but uses Hamerly's
+// algorithm (https://doi.org/10.1137/1.9781611972801.12) to skip distance
+// calculations. Each point keeps bounds on its distance to its own mean and to
+// the closest other mean, and the triangle inequality rules out most
+// reassignments without computing any distances. Rounding in the bounds can
+// leave a point right on a boundary with the other mean.
+std::pair<std::vector<fpreal3>, std::vector<uinteger>>
+kmeans_hamerly(const span<fpreal3> _data,
+               uinteger _k,
+               uinteger _maxIterations = 100u,
+               fpreal _tolerance       = 1e-5_f);
+
+enum class KMeansAlgorithm
+{
+  LLOYD,
+  HAMERLY
+};
+
+// Clusters a stratified random sample of _sampleSize points with _algorithm,
+// then assigns every point to the resulting means in a single full pass. The
+// whole data set is clustered when _sampleSize is zero or covers it. The
+// sample is drawn with a fixed seed and the sums are reduced in a fixed order,
+// so the same data always gives the same clustering.
+std::pair<std::vector<fpreal3>, std::vector<uinteger>>
+kmeans_sampled(const span<fpreal3> _data,
+               uinteger _k,
+               uinteger _sampleSize,
+               KMeansAlgorithm _algorithm = KMeansAlgorithm::LLOYD,
+               uinteger _maxIterations    = 100u,
+               fpreal _tolerance          = 1e-5_f);
 
 END_AUTOTEXGEN_NAMESPACE
 
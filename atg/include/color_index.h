@@ -0,0 +1,50 @@
+#ifndef INCLUDED_COLOR_INDEX_H
+#define INCLUDED_COLOR_INDEX_H
+
+#include "types.h"
+
+#include <vector>
+
+BEGIN_AUTOTEXGEN_NAMESPACE
+
+// A match found by nearestColors, m_label is the set the pixel was taken from
+// and m_index is the pixel index itself
+struct ColorNeighbour
+{
+  fpreal m_distance2;
+  uinteger m_label;
+  uinteger m_index;
+};
+
+// Implicit k-d tree over a collection of colours. Points are stored in tree
+// order, the middle point of every range is the node that splits it along
+// m_axes of that point, and m_lower, m_upper hold the bounding box of the
+// range at the same position.
+struct ColorIndex
+{
+  std::vector<fpreal3> m_colors;
+  std::vector<uinteger> m_labels;
+  std::vector<uinteger> m_indices;
+  std::vector<uint8_t> m_axes;
+  std::vector<fpreal3> m_lower;
+  std::vector<fpreal3> m_upper;
+};
+
+// Builds an index over sets of pixels given in compressed sparse row form, the
+// pixels of set i being _indices[_offsets[i], _offsets[i + 1]). Each pixel is
+// labelled with its set i.
+ColorIndex buildColorIndex(const span<const uinteger> _offsets,
+                           const span<const uinteger> _indices,
+                           const span<const fpreal3> _colors);
+
+// Finds the _k indexed colours closest to _color, sorted nearest first.
+// io_neighbours is overwritten, passing the same vector between queries avoids
+// reallocating it.
+void nearestColors(const ColorIndex& _index,
+                   const fpreal3 _color,
+                   uinteger _k,
+                   std::vector<ColorNeighbour>& io_neighbours);
+
+END_AUTOTEXGEN_NAMESPACE
+
+#endif  // INCLUDED_COLOR_INDEX_H
@@ -13,6 +13,13 @@ fpreal filterSum(const span<const fpreal> _filter, const uinteger2 _dimensions);
 
 fpreal filterSum(const span<const fpreal> _filter, const uinteger2 _dimensions, const uinteger2 _crop);
 
+// Computes, for every pixel of an image, the sum of the filter weights that
+// pixel receives from all of the square regions of _regionScale that overlap
+// it. Crops are summed in the same order as filterSum.
+std::vector<fpreal> filterSumPlane(const span<const fpreal> _filter,
+                                   const uinteger _regionScale,
+                                   const uinteger2 _imageDim);
+
 END_AUTOTEXGEN_NAMESPACE
 
 #endif//INCLUDED_FILTER_H
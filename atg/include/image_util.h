@@ -5,8 +5,26 @@
 
 #include <OpenImageIO/imageio.h>
 
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <tbb/task_group.h>
+
 BEGIN_AUTOTEXGEN_NAMESPACE
 
+// Three channel image stored as one contiguous plane per channel (structure of
+// arrays), so that the per pixel passes can be vectorised
+struct PlanarImage3
+{
+  std::vector<fpreal> m_channels[3];
+};
+
 void clampExtremeties(span<fpreal> io_image);
 
 void clampExtremeties(span<fpreal3> io_image);
@@ -16,14 +34,175 @@ std::vector<fpreal> calculateIntensity(const span<fpreal3> _image);
 std::vector<fpreal3> calculateChroma(const span<fpreal3> _sourceImage,
                                            const span<fpreal> _intensity);
 
+// Writes _image scaled per pixel by _scale, in interleaved form. Uses AVX2
+// when compiled for an AVX2 target and scalar code otherwise, the choice is
+// made at compile time only. Define AUTOTEXGEN_SCALAR_KERNELS to force the
+// scalar code, as common.pri targets AVX2.
+void scaleToInterleaved(const PlanarImage3& _image,
+                        const span<fpreal> _scale,
+                        fpreal3* o_image);
+
+// Everything the separation needs from a source image
+struct PreparedImage
+{
+  std::vector<fpreal> m_intensity;
+  PlanarImage3 m_chroma;
+  fpreal3 m_maxChroma;
+};
+
+// Clamps the extreme highlights and shadows of _image, then extracts its
+// intensity, chroma and largest chroma value, all in a single parallel pass.
+// The source image itself is left unclamped.
+PreparedImage prepareImage(const span<fpreal3> _image);
+
+// As above, but reuses the storage of o_prepared
+void prepareImage(const span<fpreal3> _image, PreparedImage& o_prepared);
+
+// Halves the resolution of an image by averaging 2x2 blocks of pixels, the
+// result has dimensions (_imageDim + 1) / 2 with odd edges clamped
+std::vector<fpreal3> downsample(const span<fpreal3> _image,
+                                const uinteger2 _imageDim);
+
+// Bilinearly resamples a single channel image, treating pixels as sampled at
+// their centres
+std::vector<fpreal> resampleBilinear(const span<fpreal> _image,
+                                     const uinteger2 _imageDim,
+                                     const uinteger2 _newDim);
+
+// Reads an image a band of rows at a time, converting each band from the
+// file's native type as it is read, so only the band is ever held in that
+// type. Tiled files are read a whole row of tiles at a time.
+class ImageReader
+{
+public:
+  // Rows per band used by readImage
+  static constexpr uinteger BAND_ROWS = 64u;
+
+  // Throws std::runtime_error when the file cannot be opened
+  explicit ImageReader(const string_view _filename);
+
+  uinteger2 dimensions() const;
+
+  // Reads the rows [_begin, _end) into o_data, filling as many channels of
+  // each T as the file provides
+  template <typename T, typename E = fpreal>
+  void readRows(const uinteger _begin, const uinteger _end, T* o_data);
+
+  // Calls _f(begin, end, rows) for every band of _bandRows rows in order. The
+  // next band is read in the background while _f processes the current one,
+  // so only two bands are held at once.
+  template <typename T, typename E = fpreal, typename F>
+  void forEachBand(const uinteger _bandRows, F&& _f);
+
+private:
+  void readRows(const uinteger _begin,
+                const uinteger _end,
+                const uinteger _numChannels,
+                const OIIO::TypeDesc _format,
+                const uinteger _pixelStride,
+                void* o_data);
+
+  std::unique_ptr<OIIO::ImageInput, void (*)(OIIO::ImageInput*)> m_input;
+  // Rows of whole tiles, for tiled files
+  std::vector<char> m_tileRows;
+};
+
+// Writes an image a band of rows at a time, the rows must be written in order
+// and each band is converted to the file's type as it is written
+class ImageWriter
+{
+public:
+  // Rows per band used by writeImage
+  static constexpr uinteger BAND_ROWS = 64u;
+
+  // Throws std::runtime_error when the file cannot be created
+  ImageWriter(const string_view _filename,
+              const uinteger2 _imageDim,
+              const uinteger _numChannels,
+              const OIIO::TypeDesc _format = TypeDescMap<fpreal>::type);
+
+  // Writes the rows [_begin, _end) from _data
+  template <typename T, typename E = fpreal>
+  void writeRows(const uinteger _begin, const uinteger _end, const T* _data);
+
+  // Completes the file, throwing std::runtime_error if it could not be
+  // finished. Destroying an open writer closes it without reporting errors.
+  void close();
+
+private:
+  void writeRows(const uinteger _begin,
+                 const uinteger _end,
+                 const OIIO::TypeDesc _format,
+                 const uinteger _pixelStride,
+                 const void* _data);
+
+  std::unique_ptr<OIIO::ImageOutput, void (*)(OIIO::ImageOutput*)> m_output;
+  std::string m_filename;
+};
+
+// Writes _data to _filename a band at a time, printing the filename first
 template <typename T, typename E = fpreal>
 void writeImage(const string_view _filename,
                 const T* _data,
                 const uinteger2 _imageDim);
 
+// As writeImage, without printing anything
+template <typename T, typename E = fpreal>
+void writeImageQuietly(const string_view _filename,
+                       const T* _data,
+                       const uinteger2 _imageDim);
+
 template <typename T, typename E = fpreal>
 auto readImage(const string_view _filename);
 
+// Writes images on a small pool of background threads, so that encoding
+// overlaps whatever the caller does next. The writer takes ownership of each
+// buffer. Failures are held until flush, which rethrows the first of them.
+class AsyncImageWriter
+{
+public:
+  explicit AsyncImageWriter(const uinteger _numThreads = 2u);
+
+  // Waits for the queued images, any failures are discarded
+  ~AsyncImageWriter();
+
+  AsyncImageWriter(const AsyncImageWriter&) = delete;
+  AsyncImageWriter& operator=(const AsyncImageWriter&) = delete;
+
+  // Queues _data to be written to _filename, may be called from any thread.
+  // The filename is printed here rather than by the writing thread, so
+  // messages from concurrent writes can't interleave.
+  template <typename T, typename E = fpreal>
+  void enqueue(std::string _filename,
+               std::unique_ptr<T[]> _data,
+               const uinteger2 _imageDim);
+
+  template <typename T, typename E = fpreal>
+  void enqueue(std::string _filename,
+               std::vector<T> _data,
+               const uinteger2 _imageDim);
+
+  // Blocks until every queued image has been written, rethrowing the first
+  // failure since the last flush
+  void flush();
+
+private:
+  void push(const std::string& _filename, std::function<void()> _job);
+  void run();
+
+  std::mutex m_mutex;
+  // Signalled when a job is queued, or the writer is shutting down
+  std::condition_variable m_queued;
+  // Signalled when the last outstanding job completes
+  std::condition_variable m_idle;
+  std::deque<std::function<void()>> m_jobs;
+  // Jobs queued or being written
+  uinteger m_outstanding = 0u;
+  bool m_stopping        = false;
+  std::exception_ptr m_error;
+  std::vector<std::thread> m_threads;
+};
+
 #include "image_util.inl"  //template definitions
 
 END_AUTOTEXGEN_NAMESPACE
@@ -1,54 +1,112 @@
-template <typename T, typename E = fpreal>
+template <typename T, typename E>
+void ImageReader::readRows(const uinteger _begin,
+                           const uinteger _end,
+                           T* o_data)
+{
+  readRows(_begin,
+           _end,
+           sizeof(T) / sizeof(E),
+           TypeDescMap<E>::type,
+           sizeof(T),
+           o_data);
+}
+
+template <typename T, typename E, typename F>
+void ImageReader::forEachBand(const uinteger _bandRows, F&& _f)
+{
+  const auto dim = dimensions();
+  std::vector<T> bands[2];
+  for (auto& band : bands)
+    band.resize(dim.x * _bandRows);
+
+  uinteger current = 0u;
+  readRows<T, E>(0u, std::min(_bandRows, dim.y), bands[current].data());
+  for (uinteger begin = 0u; begin < dim.y; begin += _bandRows)
+  {
+    const uinteger end     = std::min(begin + _bandRows, dim.y);
+    const uinteger nextEnd = std::min(end + _bandRows, dim.y);
+    tbb::task_group prefetch;
+    if (end < dim.y)
+    {
+      prefetch.run([&, current] {
+        readRows<T, E>(end, nextEnd, bands[current ^ 1u].data());
+      });
+    }
+    _f(begin, end, span<T>{bands[current].data(), dim.x * (end - begin)});
+    prefetch.wait();
+    current ^= 1u;
+  }
+}
+
+template <typename T, typename E>
+void ImageWriter::writeRows(const uinteger _begin,
+                            const uinteger _end,
+                            const T* _data)
+{
+  writeRows(_begin, _end, TypeDescMap<E>::type, sizeof(T), _data);
+}
+
+template <typename T, typename E>
 void writeImage(const string_view _filename,
                 const T* _data,
                 const uinteger2 _imageDim)
 {
   std::cout << "Writing image to " << _filename << '\n';
-  // OpenImageIO namespace
-  using namespace OIIO;
-  // unique_ptr with custom deleter to close file on exit
-  std::unique_ptr<ImageOutput, void (*)(ImageOutput*)> output(
-    ImageOutput::create(_filename.data())
-#if OIIO_VERSION >= 10900
-      .release()
-#endif
-      ,
-    [](auto ptr) {
-      ptr->close();
-      delete ptr;
-    });
-  ImageSpec is(
-    _imageDim.x, _imageDim.y, sizeof(T) / sizeof(E), TypeDescMap<E>::type);
-  output->open(_filename.data(), is);
-  output->write_image(TypeDescMap<E>::type, _data);
-}
-
-template <typename T, typename E = fpreal>
+  writeImageQuietly<T, E>(_filename, _data, _imageDim);
+}
+
+template <typename T, typename E>
+void writeImageQuietly(const string_view _filename,
+                       const T* _data,
+                       const uinteger2 _imageDim)
+{
+  ImageWriter output(
+    _filename, _imageDim, sizeof(T) / sizeof(E), TypeDescMap<E>::type);
+  for (uinteger y = 0u; y < _imageDim.y; y += ImageWriter::BAND_ROWS)
+  {
+    const uinteger end = std::min(y + ImageWriter::BAND_ROWS, _imageDim.y);
+    output.writeRows<T, E>(y, end, _data + y * _imageDim.x);
+  }
+  output.close();
+}
+
+template <typename T, typename E>
+void AsyncImageWriter::enqueue(std::string _filename,
+                               std::unique_ptr<T[]> _data,
+                               const uinteger2 _imageDim)
+{
+  // std::function must be copyable, so share the buffer with the job
+  std::shared_ptr<T> data(_data.release(), std::default_delete<T[]>());
+  push(_filename, [filename = _filename, data, _imageDim] {
+    writeImageQuietly<T, E>(filename, data.get(), _imageDim);
+  });
+}
+
+template <typename T, typename E>
+void AsyncImageWriter::enqueue(std::string _filename,
+                               std::vector<T> _data,
+                               const uinteger2 _imageDim)
+{
+  auto data = std::make_shared<std::vector<T>>(std::move(_data));
+  push(_filename, [filename = _filename, data, _imageDim] {
+    writeImageQuietly<T, E>(filename, data->data(), _imageDim);
+  });
+}
+
+template <typename T, typename E>
 auto readImage(const string_view _filename)
 {
-  // OpenImageIO namespace
-  using namespace OIIO;
-  // unique_ptr with custom deleter to close file on exit
-  std::unique_ptr<ImageInput, void (*)(ImageInput*)> input(
-    ImageInput::open(_filename.data())
-#if OIIO_VERSION >= 10900
-      .release()
-#endif
-      ,
-    [](auto ptr) {
-      ptr->close();
-      delete ptr;
-    });
-  // Get the image specification and store the dimensions
-  auto&& spec = input->spec();
-  uinteger2 dim{spec.width, spec.height};
-
-  // Allocated an array for our data
+  ImageReader input(_filename);
+  const auto dim = input.dimensions();
+
+  // Allocated an array for our data, and read straight into it a band at a
+  // time, i.e. for fpreal3 we ignore the alpha channel
   auto data = std::make_unique<T[]>(dim.x * dim.y);
-  // Read the data into our array, with a specified stride of how many floats
-  // the user requested, i.e. for fpreal3 we ignore the alpha channel
-  input->read_image(
-    TypeDescMap<E>::type, data.get(), sizeof(T), AutoStride, AutoStride);
+  for (uinteger y = 0u; y < dim.y; y += ImageReader::BAND_ROWS)
+  {
+    const uinteger end = std::min(y + ImageReader::BAND_ROWS, dim.y);
+    input.readRows<T, E>(y, end, data.get() + y * dim.x);
+  }
 
   // return an owning span
   struct OwningSpan
@@ -8,12 +8,58 @@
 
 BEGIN_AUTOTEXGEN_NAMESPACE
 
+// Sets each pixel to the product of the values in the window [x - h, x + h)
+// around it, with h = (_structuringElement - 1) * _iter / 2. Masks of only
+// zeros and ones are eroded as a BitMask, at a cost per pixel that does not
+// depend on the window.
 void erode(fpreal* _in,
            fpreal* o_out,
            uinteger2 _imageDim,
            uinteger2 _structuringElement,
            uinteger _iter);
 
+// Binary image packed 64 pixels to a word, each row starts on a new word and
+// the bits past the end of a row are zero
+struct BitMask
+{
+  uinteger2 m_dim;
+  uinteger m_rowWords;
+  std::vector<uint64_t> m_words;
+};
+
+BitMask makeBitMask(uinteger2 _dim);
+
+inline void setBit(BitMask& io_mask, uinteger _x, uinteger _y)
+{
+  io_mask.m_words[_y * io_mask.m_rowWords + _x / 64u] |= uint64_t(1u)
+                                                         << (_x % 64u);
+}
+
+inline bool testBit(const BitMask& _mask, uinteger _x, uinteger _y)
+{
+  return (_mask.m_words[_y * _mask.m_rowWords + _x / 64u] >> (_x % 64u)) & 1u;
+}
+
+// Produces the same result as erode on a mask of zeros and ones. The box is
+// separated into a pass that clears around each run of zeros in a row, and a
+// van Herk/Gil-Werman running minimum down the columns, 64 pixels at a time,
+// so the cost per pixel does not depend on the size of the box.
+void erode(const BitMask& _in,
+           BitMask& o_out,
+           uinteger2 _structuringElement,
+           uinteger _iter);
+
+// Erodes every label of a label image in one traversal. Each label is eroded
+// as erode would erode a mask of that label alone, using a box of half extent
+// _kernelHalves[label]. Pixels that do not survive, and pixels that are
+// already _excluded, are written as _excluded. A label whose half extent is
+// zero along either axis is left uneroded. o_labels may be _labels itself.
+void erodeLabels(const span<const uint8_t> _labels,
+                 uinteger2 _imageDim,
+                 const span<const uinteger2> _kernelHalves,
+                 uint8_t _excluded,
+                 uint8_t* o_labels);
+
 END_AUTOTEXGEN_NAMESPACE
 
 #endif  // INCLUDED_MORPH_H
@@ -6,11 +6,34 @@
 
 BEGIN_AUTOTEXGEN_NAMESPACE
 
-std::vector<fpreal3> computeRelativeNormals(const_span<fpreal> _shading, const fpreal3 _lightDirection);
+// Iterates until no normal moves further than _tolerance in a pass, or
+// _maxIterations is reached. Starts from _initialNormals when provided, such
+// as the result of a previous run under different lighting.
+std::vector<fpreal3> computeRelativeNormals(
+  const_span<fpreal> _shading,
+  const fpreal3 _lightDirection,
+  const uinteger _maxIterations  = 25u,
+  const fpreal _tolerance        = 0.0_f,
+  const fpreal3* _initialNormals = nullptr);
 
 std::vector<fpreal2> computeRelativeHeights(fpreal3* _normals, uinteger2 _imageDim);
 
-std::vector<fpreal> computeAbsoluteHeights(fpreal2* _relativeHeights, uinteger2 _imageDim);
+enum class HeightSolver
+{
+  JACOBI,
+  MULTIGRID
+};
+
+// Integrates the relative heights into absolute heights normalised to [0, 1].
+// JACOBI runs a fixed 2000 sweeps, MULTIGRID runs up to _maxCycles multigrid
+// cycles, stopping once the residual relative to the right hand side falls to
+// _tolerance.
+std::vector<fpreal> computeAbsoluteHeights(
+  fpreal2* _relativeHeights,
+  uinteger2 _imageDim,
+  const HeightSolver _solver = HeightSolver::JACOBI,
+  const fpreal _tolerance    = 1e-4_f,
+  const uinteger _maxCycles  = 100u);
 
 END_AUTOTEXGEN_NAMESPACE
 
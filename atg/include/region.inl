@@ -4,8 +4,9 @@ void for_each_local_pixel2D(F&& _func,
                           const uinteger2 _regionStart,
                           const uinteger _regionScale) noexcept
 {
-  for (uinteger x = 0u; x < _regionScale; ++x)
-    for (uinteger y = 0u; y < _regionScale; ++y)
+  // Images are stored row major, so walk each row of the region in turn
+  for (uinteger y = 0u; y < _regionScale; ++y)
+    for (uinteger x = 0u; x < _regionScale; ++x)
     {
       uinteger2 localCoord{x, y};
       auto pixelCoord = localCoord + _regionStart;
@@ -1,35 +1,190 @@
 #ifndef INCLUDED_SEPARATION_H
 #define INCLUDED_SEPARATION_H
 
+#include "image_util.h"
 #include "region.h"
 #include "types.h"
 
+#include <tbb/enumerable_thread_specific.h>
+
 #include <vector>
 
 BEGIN_AUTOTEXGEN_NAMESPACE
 
+// Quantised chroma value, see hashChroma
+using ChromaId = uint16_t;
+// Most quantisation slots per chroma axis whose ids still fit in a ChromaId
+constexpr uinteger MAX_CHROMA_SLOTS = 256u;
+
+// Sparse chroma histogram over a palette of chroma values. Entries are indexed
+// by palette slot, but only the m_numOccupied slots listed in m_occupied hold
+// valid data, so clearing and reading costs scale with the number of distinct
+// chroma values in a region rather than the number of possible ones.
+struct ChromaHistogram
+{
+  std::vector<double> m_intensitySums;
+  std::vector<uinteger> m_counts;
+  std::vector<uinteger> m_occupied;
+  // Position of each slot within m_occupied, allowing removal in O(1)
+  std::vector<uinteger> m_position;
+  uinteger m_numOccupied = 0u;
+};
+
+// Palette of the chroma values present in a band of image rows. Slots are
+// handed out as values enter the band and recycled when they leave it, so the
+// palette only grows to the number of distinct values seen in a single band.
+struct ChromaPalette
+{
+  // Number of pixels in the band using each ChromaId
+  std::vector<uinteger> m_counts;
+  // Palette slot of each ChromaId, only valid while its count is non zero
+  std::vector<uinteger> m_index;
+  std::vector<uinteger> m_free;
+  uinteger m_size = 0u;
+};
+
+void resizeHistogram(ChromaHistogram& io_histogram,
+                     const uinteger _paletteSize);
+
 uinteger hashChroma(const fpreal3 _chroma,
                     const fpreal3 _max,
                     const uinteger _slots) noexcept;
 
+// Quantises the chroma of every pixel once, _slots must be no more than
+// MAX_CHROMA_SLOTS for the result to fit in a ChromaId
+void calculateChromaIds(const PlanarImage3& _chroma,
+                        const fpreal3 _maxChroma,
+                        const uinteger _slots,
+                        ChromaId* o_chromaIds);
+
+// Estimates the albedo intensity of every chroma value present in _region.
+// _paletteIndex maps a ChromaId to its slot in io_histogram and
+// io_estimatedAlbedoIntensity, only the slots present in the region are
+// written.
 void estimateAlbedoIntensities(const Region _region,
                                fpreal* io_estimatedAlbedoIntensity,
+                               ChromaHistogram& io_histogram,
                                const fpreal* _intensity,
                                const fpreal* _albedoIntensity,
-                               const fpreal3* _chroma,
-                               const fpreal3 _maxChroma,
-                               const uinteger _numSlots,
+                               const ChromaId* _chromaIds,
+                               const uinteger* _paletteIndex,
                                const uinteger2 _imageDimensions,
                                const uinteger _regionScale) noexcept;
 
-void seperateShading(const span<fpreal3> _sourceImage,
-                     fpreal3* io_albedo,
-                     fpreal* io_shadingIntensity,
-                     const uinteger2 _imageDimensions,
-                     const uinteger _regionScale,
-                     const uinteger _directIterations,
-                     const uinteger _intensityIterations,
-                     const uinteger _chromaSlots);
+// Estimates the albedo intensities for a run of horizontally adjacent regions,
+// starting at _firstRegion. The chroma histogram is built once for the first
+// region and then slid along the row, removing the column that leaves the
+// window and adding the one that enters it. Estimates for the n'th region are
+// written to io_estimatedAlbedoIntensity + n * _paletteSize.
+void estimateAlbedoIntensitiesSliding(const Region _firstRegion,
+                                      const uinteger _numRegions,
+                                      fpreal* io_estimatedAlbedoIntensity,
+                                      ChromaHistogram& io_histogram,
+                                      const fpreal* _intensity,
+                                      const fpreal* _albedoIntensity,
+                                      const ChromaId* _chromaIds,
+                                      const uinteger* _paletteIndex,
+                                      const uinteger _paletteSize,
+                                      const uinteger2 _imageDimensions,
+                                      const uinteger _regionScale) noexcept;
+
+// Owns every scratch buffer used while separating an image. Buffers are kept
+// between calls, so once an image has been separated, further images of the
+// same size and region scale are separated without any heap allocation.
+class SeparationContext
+{
+public:
+  // Iterations stop early once the largest change in albedo intensity over a
+  // pass, or in shading intensity over a direct iteration, falls to
+  // _tolerance. An initial albedo intensity estimate may be provided,
+  // otherwise the source intensity is used. Chroma is quantised relative to
+  // _maxChroma when given, rather than the largest chroma of the image.
+  // Returns the number of expectation passes that were run.
+  uinteger separate(const span<fpreal3> _sourceImage,
+                    fpreal3* io_albedo,
+                    fpreal* io_shadingIntensity,
+                    const uinteger2 _imageDimensions,
+                    const uinteger _regionScale,
+                    const uinteger _directIterations,
+                    const uinteger _intensityIterations,
+                    const uinteger _chromaSlots,
+                    const bool _slidingWindow,
+                    const fpreal _tolerance,
+                    const fpreal* _initialAlbedoIntensity = nullptr,
+                    const fpreal3* _maxChroma             = nullptr);
+
+private:
+  // Rebuilds the layout dependent data when the size or scale changes
+  void resize(const uinteger2 _imageDimensions, const uinteger _regionScale);
+
+  // Layout dependent data, these never change between iterations
+  uinteger2 m_imageDim;
+  uinteger m_regionScale = 0u;
+  RegionData m_regions;
+  std::vector<fpreal> m_filter;
+  // Sum of the filter weights each pixel receives
+  std::vector<fpreal> m_filterSums;
+
+  // Per image scratch
+  PreparedImage m_prepared;
+  std::vector<fpreal> m_albedoIntensity;
+  std::vector<fpreal> m_interimAlbedoIntensity;
+  std::vector<ChromaId> m_chromaIds;
+  // Histogram estimates for a chunk of a row of regions, indexed by palette
+  // slot
+  std::vector<fpreal> m_rowEstimates;
+  ChromaPalette m_palette;
+  tbb::enumerable_thread_specific<ChromaHistogram> m_histograms;
+};
+
+// Separates a single image using a temporary SeparationContext, see
+// SeparationContext::separate.
+uinteger seperateShading(const span<fpreal3> _sourceImage,
+                         fpreal3* io_albedo,
+                         fpreal* io_shadingIntensity,
+                         const uinteger2 _imageDimensions,
+                         const uinteger _regionScale,
+                         const uinteger _directIterations,
+                         const uinteger _intensityIterations,
+                         const uinteger _chromaSlots,
+                         const bool _slidingWindow,
+                         const fpreal _tolerance,
+                         const fpreal* _initialAlbedoIntensity = nullptr,
+                         const fpreal3* _maxChroma = nullptr);
+
+// Coarse to fine separation. The source image is halved _levels - 1 times and
+// fully separated at the coarsest level, with the region scale halved to
+// match. The upsampled albedo intensity then seeds _refineIterations
+// expectation passes at each finer level.
+uinteger seperateShadingPyramid(const span<fpreal3> _sourceImage,
+                                fpreal3* io_albedo,
+                                fpreal* io_shadingIntensity,
+                                const uinteger2 _imageDimensions,
+                                const uinteger _regionScale,
+                                const uinteger _directIterations,
+                                const uinteger _intensityIterations,
+                                const uinteger _chromaSlots,
+                                const bool _slidingWindow,
+                                const fpreal _tolerance,
+                                const uinteger _levels,
+                                const uinteger _refineIterations);
+
+// Out of core separation, streaming the image from _sourceFile and writing the
+// results to _albedoFile and _shadingFile. The image is processed in bands of
+// _tileSize rows, each split into _tileSize wide tiles that are separated
+// independently with an R - 1 pixel halo. Peak memory is bounded by the band
+// size rather than the image size. Extreme highlights and shadows are clamped
+// as the source is read.
+void seperateShadingTiled(const string_view _sourceFile,
+                          const string_view _albedoFile,
+                          const string_view _shadingFile,
+                          const uinteger _tileSize,
+                          const uinteger _regionScale,
+                          const uinteger _directIterations,
+                          const uinteger _intensityIterations,
+                          const uinteger _chromaSlots,
+                          const bool _slidingWindow,
+                          const fpreal _tolerance);
 
 END_AUTOTEXGEN_NAMESPACE
 
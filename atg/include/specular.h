@@ -1,22 +1,49 @@
 #ifndef INCLUDED_SPECULAR_H
 #define INCLUDED_SPECULAR_H
 
+#include "cluster.h"
 #include "types.h"
 
 #include <vector>
 
 BEGIN_AUTOTEXGEN_NAMESPACE
 
-std::vector<std::vector<uinteger>> initMaterialSets(const span<fpreal3> _albedo,
-                                                    uinteger2 _imageDim,
-                                                    uinteger _numSets);
-
-void removeOutliers(span<std::vector<uinteger>> _materialTypes,
-                    const span<fpreal3> _albedo);
+// Material set membership, stored as a set label per pixel. Pixels that belong
+// to no set are labelled EXCLUDED, so at most 255 sets can be represented.
+//
+// m_offsets and m_indices list the pixels of each set in compressed sparse row
+// form, the pixels of set i being m_indices[m_offsets[i], m_offsets[i + 1]) in
+// ascending order. The functions below keep them in step with m_labels, call
+// buildSetIndices after editing the labels directly.
+struct MaterialSets
+{
+  static constexpr uint8_t EXCLUDED = 0xFFu;
+
+  uinteger m_numSets;
+  std::vector<uint8_t> m_labels;
+  std::vector<uinteger> m_offsets;
+  std::vector<uinteger> m_indices;
+};
+
+// Rebuilds the set index lists of io_sets from its labels, reusing their
+// storage
+void buildSetIndices(MaterialSets& io_sets);
+
+// Clusters the albedo into _numSets material sets. When _sampleSize is non
+// zero the means are found from a sample of that many pixels, see
+// kmeans_sampled.
+MaterialSets
+initMaterialSets(const span<fpreal3> _albedo,
+                 uinteger2 _imageDim,
+                 uinteger _numSets,
+                 KMeansAlgorithm _algorithm = KMeansAlgorithm::LLOYD,
+                 uinteger _sampleSize       = 0u);
+
+// Excludes the pixels whose closest colours mostly belong to other sets
+void removeOutliers(MaterialSets& io_sets, const span<fpreal3> _albedo);
 
 std::vector<std::vector<fpreal>>
-computeProbability(const span<std::vector<uinteger>> _materialSets,
-                   const span<fpreal3> _albedo);
+computeProbability(const MaterialSets& _sets, const span<fpreal3> _albedo);
 
 END_AUTOTEXGEN_NAMESPACE
 
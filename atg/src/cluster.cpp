@@ -5,11 +5,14 @@
 #include <cassert>
 #include <cstddef>
 #include <cstdint>
+#include <limits>
 #include <gtx/fast_square_root.hpp>
 #include <gtx/norm.hpp>
 #include <random>
 #include <tuple>
 #include <type_traits>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_reduce.h>
 
 BEGIN_AUTOTEXGEN_NAMESPACE
 
@@ -34,19 +37,21 @@ std::vector<T> findClosestDistances(const std::vector<vec<N, T, Q>>& _means,
   return distances;
 }
 
+// Using a very simple PRBS generator, parameters selected according to
+// https://en.wikipedia.org/wiki/Linear_congruential_generator#Parameters_in_common_use
+using RandomEngine = std::linear_congruential_engine<uint64_t,
+                                                     6364136223846793005,
+                                                     1442695040888963407,
+                                                     UINT64_MAX>;
+// Fixed seed, so that clustering the same image always gives the same sets
+constexpr uint64_t k_randomSeed = 0x9e3779b97f4a7c15;
+
 template <typename T, integer N, qualifier Q>
 std::vector<vec<N, T, Q>> kmeansPlusPlusSeeds(const span<vec<N, T, Q>>& _data,
                                               uinteger _k)
 {
   std::vector<vec<N, T, Q>> means(_k);
-  // Using a very simple PRBS generator, parameters selected according to
-  // https://en.wikipedia.org/wiki/Linear_congruential_generator#Parameters_in_common_use
-  std::random_device rand_device;
-  std::linear_congruential_engine<uint64_t,
-                                  6364136223846793005,
-                                  1442695040888963407,
-                                  UINT64_MAX>
-    rand_engine(rand_device());
+  RandomEngine rand_engine(k_randomSeed);
 
   // Select first mean at random from the set, why not 0
   means[0] = _data[0];
@@ -64,90 +69,321 @@ std::vector<vec<N, T, Q>> kmeansPlusPlusSeeds(const span<vec<N, T, Q>>& _data,
   return means;
 }
 
-/*
-Calculate the index of the mean a particular data point is closest to (euclidean
-distance)
-*/
+// Per cluster sums of the data points assigned to each cluster, kept in double
+// precision
 template <typename T, integer N, qualifier Q>
-uinteger findClosestMean(const vec<N, T, Q>& _point,
-                         const std::vector<vec<N, T, Q>>& _means)
+struct ClusterSums
 {
-  T smallest_distance = glm::distance2(_point, _means[0]);
-  uinteger index      = 0u;
-  for (uinteger i = 1u; i < _means.size(); ++i)
+  ClusterSums(const uinteger _k) : m_sums(_k), m_counts(_k, 0u)
   {
-    auto distance = glm::distance2(_point, _means[i]);
-    if (distance < smallest_distance)
-    {
-      smallest_distance = distance;
-      index             = i;
-    }
   }
-  return index;
+  std::vector<vec<N, double, Q>> m_sums;
+  std::vector<uinteger> m_counts;
+};
+
+// Blocks of points summed by each task. The deterministic reduction splits
+// and joins the same blocks in the same order on every run, so identical
+// assignments always give bit identical sums and means.
+constexpr uinteger k_reduceGrain = 4096u;
+
+// Runs _body over blocks of the points, and adds up the sums it returns
+template <typename T, integer N, qualifier Q, typename F>
+ClusterSums<T, N, Q>
+reduceClusters(const uinteger _numPoints, const uinteger _k, const F& _body)
+{
+  return tbb::parallel_deterministic_reduce(
+    tbb::blocked_range<uinteger>{0u, _numPoints, k_reduceGrain},
+    ClusterSums<T, N, Q>(_k),
+    _body,
+    [_k](ClusterSums<T, N, Q> a, const ClusterSums<T, N, Q>& b) {
+      for (uinteger j = 0u; j < _k; ++j)
+      {
+        a.m_sums[j] += b.m_sums[j];
+        a.m_counts[j] += b.m_counts[j];
+      }
+      return a;
+    });
+}
+
+// The mean of cluster _j, which must not be empty
+template <typename T, integer N, qualifier Q>
+vec<N, T, Q> clusterMean(const ClusterSums<T, N, Q>& _sums, const uinteger _j)
+{
+  return vec<N, T, Q>(_sums.m_sums[_j] /
+                      static_cast<double>(_sums.m_counts[_j]));
 }
 
 /*
-Calculate the index of the mean each data point is closest to (euclidean
-distance).
+Assign each data point to the mean it is closest to (euclidean distance), and
+sum the points of each cluster, in a single parallel pass. Within a block the
+distances to every mean are computed for several points at once in SIMD lanes.
 */
 template <typename T, integer N, qualifier Q>
-std::vector<uinteger> calculateClusters(const span<vec<N, T, Q>>& _data,
-                                        const std::vector<vec<N, T, Q>>& _means)
+ClusterSums<T, N, Q>
+calculateClusters(const span<vec<N, T, Q>>& _data,
+                  const std::vector<vec<N, T, Q>>& _means,
+                  std::vector<uinteger>& o_clusters)
 {
-  std::vector<uinteger> clusters;
-  for (auto& point : _data)
+  const uinteger k         = _means.size();
+  const uinteger numPoints = _data.size();
+  o_clusters.resize(numPoints);
+  // Store the means as one array per component, so that each lane reads the
+  // same mean
+  std::array<std::vector<T>, N> means;
+  for (integer c = 0; c < N; ++c)
   {
-    clusters.push_back(findClosestMean(point, _means));
+    means[c].resize(k);
+    for (uinteger j = 0u; j < k; ++j)
+      means[c][j] = _means[j][c];
   }
-  return clusters;
+
+  return reduceClusters<T, N, Q>(
+    numPoints, k, [&](auto&& r, ClusterSums<T, N, Q> sums) {
+      const uinteger begin = r.begin();
+      const uinteger end   = r.end();
+#pragma omp simd
+      for (uinteger i = begin; i < end; ++i)
+      {
+        T smallest_distance = std::numeric_limits<T>::max();
+        uinteger index      = 0u;
+        for (uinteger j = 0u; j < k; ++j)
+        {
+          T distance = T(0);
+          for (integer c = 0; c < N; ++c)
+          {
+            const T d = _data[i][c] - means[c][j];
+            distance += d * d;
+          }
+          if (distance < smallest_distance)
+          {
+            smallest_distance = distance;
+            index             = j;
+          }
+        }
+        o_clusters[i] = index;
+      }
+      for (uinteger i = begin; i < end; ++i)
+      {
+        sums.m_sums[o_clusters[i]] += vec<N, double, Q>(_data[i]);
+        ++sums.m_counts[o_clusters[i]];
+      }
+      return sums;
+    });
 }
 
 /*
-Calculate means based on data points and their cluster assignments.
+Calculate means from the per cluster sums, returning the furthest any mean
+moved. Empty clusters keep their old mean.
 */
 template <typename T, integer N, qualifier Q>
-std::vector<vec<N, T, Q>>
-calculateMeans(const span<vec<N, T, Q>>& _data,
-               const std::vector<uinteger>& _clusters,
-               const std::vector<vec<N, T, Q>>& _old_means,
-               uinteger _k)
+T calculateMeans(const ClusterSums<T, N, Q>& _sums,
+                 std::vector<vec<N, T, Q>>& io_means)
 {
-  std::vector<vec<N, T, Q>> means(_k);
-  std::vector<uinteger> count(_k);
-  uinteger n = std::min(static_cast<uinteger>(_clusters.size()),
-                        static_cast<uinteger>(_data.size()));
-  for (uinteger i = 0; i < n; ++i)
+  T movement = T(0);
+  for (uinteger i = 0; i < io_means.size(); ++i)
   {
-    means[_clusters[i]] += _data[i];
-    ++count[_clusters[i]];
+    if (!_sums.m_counts[i])
+      continue;
+    const auto mean = clusterMean(_sums, i);
+    movement        = glm::max(movement, glm::distance(mean, io_means[i]));
+    io_means[i]     = mean;
   }
-  for (uinteger i = 0; i < _k; ++i)
+  return movement;
+}
+
+/*
+Find the closest and second closest means to a point (euclidean distance).
+*/
+template <typename T, integer N, qualifier Q>
+void findClosestTwoMeans(const vec<N, T, Q>& _point,
+                         const std::vector<vec<N, T, Q>>& _means,
+                         uinteger& o_index,
+                         T& o_closest,
+                         T& o_second)
+{
+  T closest = std::numeric_limits<T>::max();
+  T second  = std::numeric_limits<T>::max();
+  uinteger index = 0u;
+  for (uinteger i = 0u; i < _means.size(); ++i)
   {
-    means[i] = count[i] ? means[i] / static_cast<T>(count[i]) : _old_means[i];
+    const auto distance = glm::distance2(_point, _means[i]);
+    if (distance < closest)
+    {
+      second  = closest;
+      closest = distance;
+      index   = i;
+    }
+    else if (distance < second)
+    {
+      second = distance;
+    }
   }
-  return means;
+  o_index   = index;
+  o_closest = std::sqrt(closest);
+  o_second  = std::sqrt(second);
 }
 
 }  // namespace
 
 std::pair<std::vector<fpreal3>, std::vector<uinteger>>
-kmeans_lloyd(const span<fpreal3> _data, uinteger _k)
+kmeans_lloyd(const span<fpreal3> _data,
+             uinteger _k,
+             uinteger _maxIterations,
+             fpreal _tolerance)
 {
   std::vector<fpreal3> means = kmeansPlusPlusSeeds(_data, _k);
 
-  std::vector<fpreal3> old_means;
-  std::vector<fpreal3> old_old_means;
   std::vector<uinteger> clusters;
-  // Calculate new means until convergence is reached
-  // Comparison is 2*k so O(k)
-  while (means != old_means && means != old_old_means)
+  // Calculate new means until no mean moves further than the tolerance
+  for (uinteger iter = 0u; iter < _maxIterations; ++iter)
+  {
+    const auto sums = calculateClusters(_data, means, clusters);
+    if (calculateMeans(sums, means) <= _tolerance)
+      break;
+  }
+
+  return {means, clusters};
+}
+
+std::pair<std::vector<fpreal3>, std::vector<uinteger>>
+kmeans_hamerly(const span<fpreal3> _data,
+               uinteger _k,
+               uinteger _maxIterations,
+               fpreal _tolerance)
+{
+  std::vector<fpreal3> means = kmeansPlusPlusSeeds(_data, _k);
+  const uinteger numPoints   = _data.size();
+
+  // Each point keeps an upper bound on the distance to its assigned mean, and
+  // a lower bound on the distance to every other mean
+  std::vector<uinteger> clusters(numPoints);
+  std::vector<fpreal> upper(numPoints);
+  std::vector<fpreal> lower(numPoints);
+  // Distance each mean moved in the last update
+  std::vector<fpreal> movement(_k);
+  // Half the distance from each mean to its closest other mean
+  std::vector<fpreal> separation(_k);
+
+  using Sums = ClusterSums<fpreal, 3, glm::defaultp>;
+
+  // The first assignment has no bounds to work from
+  auto sums = reduceClusters<fpreal, 3, glm::defaultp>(
+    numPoints, _k, [&](auto&& r, Sums sums) {
+      const auto end = r.end();
+      for (auto i = r.begin(); i < end; ++i)
+      {
+        findClosestTwoMeans(_data[i], means, clusters[i], upper[i], lower[i]);
+        sums.m_sums[clusters[i]] += glm::dvec3(_data[i]);
+        ++sums.m_counts[clusters[i]];
+      }
+      return sums;
+    });
+
+  for (uinteger iter = 0u; iter < _maxIterations; ++iter)
+  {
+    // Move the means, recording how far each one went
+    fpreal largest = 0.0_f;
+    fpreal next    = 0.0_f;
+    uinteger furthest = 0u;
+    for (uinteger j = 0u; j < _k; ++j)
+    {
+      movement[j] = 0.0_f;
+      if (!sums.m_counts[j])
+        continue;
+      const auto mean = clusterMean(sums, j);
+      movement[j]     = glm::distance(mean, means[j]);
+      means[j]        = mean;
+      if (movement[j] > largest)
+      {
+        next     = largest;
+        largest  = movement[j];
+        furthest = j;
+      }
+      else if (movement[j] > next)
+      {
+        next = movement[j];
+      }
+    }
+    if (largest <= _tolerance)
+      break;
+
+    for (uinteger j = 0u; j < _k; ++j)
+    {
+      fpreal closest = std::numeric_limits<fpreal>::max();
+      for (uinteger m = 0u; m < _k; ++m)
+      {
+        if (m != j)
+          closest = std::min(closest, glm::distance(means[j], means[m]));
+      }
+      separation[j] = 0.5_f * closest;
+    }
+
+    sums = reduceClusters<fpreal, 3, glm::defaultp>(
+      numPoints, _k, [&](auto&& r, Sums sums) {
+        const auto end = r.end();
+        for (auto i = r.begin(); i < end; ++i)
+        {
+          auto& cluster = clusters[i];
+          // Loosen the bounds by how far the means moved
+          upper[i] += movement[cluster];
+          lower[i] -= cluster == furthest ? next : largest;
+          // A point can only change cluster if its assigned mean could be
+          // further away than both the closest other mean and half the
+          // distance between its mean and that mean's neighbour
+          const auto bound = std::max(separation[cluster], lower[i]);
+          if (upper[i] > bound)
+          {
+            // Tighten the upper bound and try again
+            upper[i] = glm::distance(_data[i], means[cluster]);
+            if (upper[i] > bound)
+            {
+              findClosestTwoMeans(
+                _data[i], means, cluster, upper[i], lower[i]);
+            }
+          }
+          sums.m_sums[cluster] += glm::dvec3(_data[i]);
+          ++sums.m_counts[cluster];
+        }
+        return sums;
+      });
+  }
+
+  return {means, clusters};
+}
+
+std::pair<std::vector<fpreal3>, std::vector<uinteger>>
+kmeans_sampled(const span<fpreal3> _data,
+               uinteger _k,
+               uinteger _sampleSize,
+               KMeansAlgorithm _algorithm,
+               uinteger _maxIterations,
+               fpreal _tolerance)
+{
+  const auto cluster = [&](const span<fpreal3> _points) {
+    return _algorithm == KMeansAlgorithm::HAMERLY
+             ? kmeans_hamerly(_points, _k, _maxIterations, _tolerance)
+             : kmeans_lloyd(_points, _k, _maxIterations, _tolerance);
+  };
+  const uinteger numPoints = _data.size();
+  if (!_sampleSize || _sampleSize >= numPoints)
+    return cluster(_data);
+
+  // Stratified sample, one point chosen at random from each of _sampleSize
+  // equal runs of the data, so the whole image is covered
+  RandomEngine rand_engine(k_randomSeed);
+  std::vector<fpreal3> samples(_sampleSize);
+  for (uinteger s = 0u; s < _sampleSize; ++s)
   {
-    clusters      = calculateClusters(_data, means);
-    old_old_means = std::move(old_means);
-    old_means     = means;
-    means         = calculateMeans(_data, clusters, old_means, _k);
+    const uinteger begin = uint64_t(s) * numPoints / _sampleSize;
+    const uinteger end   = uint64_t(s + 1u) * numPoints / _sampleSize;
+    std::uniform_int_distribution<uinteger> pick(begin, end - 1u);
+    samples[s] = _data[pick(rand_engine)];
   }
 
+  // Find the means from the sample, then assign every point to them
+  auto means = std::move(cluster(samples).first);
+  std::vector<uinteger> clusters;
+  calculateClusters(_data, means, clusters);
   return {means, clusters};
 }
 
@@ -0,0 +1,194 @@
+#include "color_index.h"
+
+#include <glm/gtx/norm.hpp>
+
+#include <algorithm>
+#include <numeric>
+#include <tbb/parallel_invoke.h>
+
+BEGIN_AUTOTEXGEN_NAMESPACE
+
+namespace
+{
+// Ranges at most this large are searched exhaustively
+constexpr uinteger k_leafSize = 8u;
+// Ranges at least this large build their two halves concurrently
+constexpr uinteger k_parallelBuildSize = 1u << 14u;
+
+// Orders [_begin, _end) so the middle element splits the range along the
+// widest axis of its bounding box, then recurses into both halves. The box of
+// every range is stored at its middle element.
+void buildRange(const std::vector<fpreal3>& _colors,
+                uinteger* _order,
+                uinteger _begin,
+                uinteger _end,
+                ColorIndex& io_index)
+{
+  if (_begin >= _end)
+    return;
+
+  fpreal3 lo = _colors[_order[_begin]];
+  fpreal3 hi = lo;
+  for (auto i = _begin + 1u; i < _end; ++i)
+  {
+    lo = glm::min(lo, _colors[_order[i]]);
+    hi = glm::max(hi, _colors[_order[i]]);
+  }
+  const auto mid        = _begin + (_end - _begin) / 2u;
+  io_index.m_lower[mid] = lo;
+  io_index.m_upper[mid] = hi;
+  if (_end - _begin <= k_leafSize)
+    return;
+
+  const auto extent = hi - lo;
+  uint8_t axis      = extent.y >= extent.z ? 1u : 2u;
+  if (extent.x >= extent.y && extent.x >= extent.z)
+    axis = 0u;
+  std::nth_element(_order + _begin,
+                   _order + mid,
+                   _order + _end,
+                   [&](const uinteger lhs, const uinteger rhs) {
+                     return _colors[lhs][axis] < _colors[rhs][axis];
+                   });
+  io_index.m_axes[mid] = axis;
+
+  if (_end - _begin >= k_parallelBuildSize)
+  {
+    tbb::parallel_invoke(
+      [&] { buildRange(_colors, _order, _begin, mid, io_index); },
+      [&] { buildRange(_colors, _order, mid + 1u, _end, io_index); });
+  }
+  else
+  {
+    buildRange(_colors, _order, _begin, mid, io_index);
+    buildRange(_colors, _order, mid + 1u, _end, io_index);
+  }
+}
+
+struct CloserNeighbour
+{
+  bool operator()(const ColorNeighbour& _lhs, const ColorNeighbour& _rhs) const
+  {
+    return _lhs.m_distance2 < _rhs.m_distance2;
+  }
+};
+
+// Keeps the _k closest points seen so far in a max heap
+void offerNeighbour(const ColorIndex& _index,
+                    const fpreal3 _color,
+                    uinteger _k,
+                    uinteger _node,
+                    std::vector<ColorNeighbour>& io_heap)
+{
+  const auto d2 = glm::distance2(_color, _index.m_colors[_node]);
+  if (io_heap.size() == _k)
+  {
+    if (!(d2 < io_heap.front().m_distance2))
+      return;
+    std::pop_heap(io_heap.begin(), io_heap.end(), CloserNeighbour{});
+    io_heap.pop_back();
+  }
+  io_heap.push_back({d2, _index.m_labels[_node], _index.m_indices[_node]});
+  std::push_heap(io_heap.begin(), io_heap.end(), CloserNeighbour{});
+}
+
+void searchRange(const ColorIndex& _index,
+                 const fpreal3 _color,
+                 uinteger _k,
+                 uinteger _begin,
+                 uinteger _end,
+                 std::vector<ColorNeighbour>& io_heap)
+{
+  if (_begin >= _end)
+    return;
+
+  // Skip the range when its bounding box is further away than our current
+  // worst match
+  const auto mid = _begin + (_end - _begin) / 2u;
+  const auto outside =
+    glm::max(glm::max(_index.m_lower[mid] - _color, fpreal3(0.0_f)),
+             _color - _index.m_upper[mid]);
+  if (io_heap.size() == _k &&
+      !(glm::dot(outside, outside) < io_heap.front().m_distance2))
+    return;
+
+  if (_end - _begin <= k_leafSize)
+  {
+    for (auto i = _begin; i < _end; ++i)
+      offerNeighbour(_index, _color, _k, i, io_heap);
+    return;
+  }
+
+  const auto axis = _index.m_axes[mid];
+  offerNeighbour(_index, _color, _k, mid, io_heap);
+
+  // Search the side containing the query first
+  if (_color[axis] < _index.m_colors[mid][axis])
+  {
+    searchRange(_index, _color, _k, _begin, mid, io_heap);
+    searchRange(_index, _color, _k, mid + 1u, _end, io_heap);
+  }
+  else
+  {
+    searchRange(_index, _color, _k, mid + 1u, _end, io_heap);
+    searchRange(_index, _color, _k, _begin, mid, io_heap);
+  }
+}
+}  // namespace
+
+ColorIndex buildColorIndex(const span<const uinteger> _offsets,
+                           const span<const uinteger> _indices,
+                           const span<const fpreal3> _colors)
+{
+  const uinteger numSets = _offsets.size() - 1u;
+  std::vector<fpreal3> colors;
+  std::vector<uinteger> labels;
+  std::vector<uinteger> indices;
+  for (uinteger label = 0u; label < numSets; ++label)
+  {
+    for (auto i = _offsets[label]; i < _offsets[label + 1u]; ++i)
+    {
+      colors.push_back(_colors[_indices[i]]);
+      labels.push_back(label);
+      indices.push_back(_indices[i]);
+    }
+  }
+
+  const uinteger numPoints = colors.size();
+  std::vector<uinteger> order(numPoints);
+  std::iota(order.begin(), order.end(), 0u);
+
+  ColorIndex index;
+  index.m_axes.resize(numPoints);
+  index.m_lower.resize(numPoints);
+  index.m_upper.resize(numPoints);
+  buildRange(colors, order.data(), 0u, numPoints, index);
+
+  // Store the points in tree order, so searches walk contiguous memory
+  index.m_colors.resize(numPoints);
+  index.m_labels.resize(numPoints);
+  index.m_indices.resize(numPoints);
+  for (uinteger i = 0u; i < numPoints; ++i)
+  {
+    index.m_colors[i]  = colors[order[i]];
+    index.m_labels[i]  = labels[order[i]];
+    index.m_indices[i] = indices[order[i]];
+  }
+
+  return index;
+}
+
+void nearestColors(const ColorIndex& _index,
+                   const fpreal3 _color,
+                   uinteger _k,
+                   std::vector<ColorNeighbour>& io_neighbours)
+{
+  io_neighbours.clear();
+  if (!_k)
+    return;
+  searchRange(
+    _index, _color, _k, 0u, _index.m_colors.size(), io_neighbours);
+  std::sort_heap(io_neighbours.begin(), io_neighbours.end(), CloserNeighbour{});
+}
+
+END_AUTOTEXGEN_NAMESPACE
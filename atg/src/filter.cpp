@@ -2,6 +2,11 @@
 #include <numeric>
 #include <cmath>
 
+#include <glm/gtx/extended_min_max.hpp>
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+
 BEGIN_AUTOTEXGEN_NAMESPACE
 
 std::vector<fpreal> gaussianFilter(uinteger2 _dim, fpreal sigma) 
@@ -65,4 +70,49 @@ fpreal filterSum(const span<const fpreal> _filter, const uinteger2 _dimensions,
   return sum;
 }
 
+namespace
+{
+uinteger2 calculateContributions(uinteger2 _coord, uinteger2 _regionDim, uinteger2 _dim)
+{
+  auto coord = _coord + 1u;
+  return glm::min(_regionDim, coord, _dim - _coord);
+}
+}
+
+std::vector<fpreal> filterSumPlane(const span<const fpreal> _filter,
+                                   const uinteger _regionScale,
+                                   const uinteger2 _imageDim)
+{
+  // A pixel can only be cropped to one of R^2 sizes, so tabulate them first.
+  // Rows are accumulated one at a time to match the summation order of
+  // filterSum exactly.
+  std::vector<fpreal> cropSums(_regionScale * _regionScale);
+  for (uinteger cx = 1u; cx <= _regionScale; ++cx)
+  {
+    fpreal sum = 0.0_f;
+    for (uinteger y = 0u; y < _regionScale; ++y)
+    {
+      for (uinteger x = 0u; x < cx; ++x)
+        sum += _filter[y * _regionScale + x];
+      cropSums[y * _regionScale + cx - 1u] = sum;
+    }
+  }
+
+  const uinteger numPixels = _imageDim.x * _imageDim.y;
+  std::vector<fpreal> plane(numPixels);
+  tbb::parallel_for(tbb::blocked_range<uinteger>{0u, numPixels},
+                    [&](auto&& r) {
+                      const auto end = r.end();
+                      for (auto i = r.begin(); i < end; ++i)
+                      {
+                        uinteger2 pixelCoord{i % _imageDim.x, i / _imageDim.x};
+                        auto crop = calculateContributions(
+                          pixelCoord, uinteger2(_regionScale), _imageDim);
+                        plane[i] =
+                          cropSums[(crop.y - 1u) * _regionScale + crop.x - 1u];
+                      }
+                    });
+  return plane;
+}
+
 END_AUTOTEXGEN_NAMESPACE
@@ -2,33 +2,209 @@
 
 #include <glm/common.hpp>
 
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
 #include <tbb/blocked_range.h>
 #include <tbb/parallel_for.h>
+#include <tbb/parallel_reduce.h>
+
+// The kernels are chosen when compiling, there is no runtime dispatch. Define
+// AUTOTEXGEN_SCALAR_KERNELS to build the scalar kernels on an AVX2 target.
+#if defined(__AVX2__) && !defined(AUTOTEXGEN_SCALAR_KERNELS)
+#define AUTOTEXGEN_AVX2_KERNELS
+#include <immintrin.h>
+#endif
 
 BEGIN_AUTOTEXGEN_NAMESPACE
 
-void clampExtremeties(span<fpreal> io_image)
+static_assert(sizeof(fpreal3) == 3u * sizeof(fpreal),
+              "Interleaved kernels require tightly packed pixels");
+#ifdef AUTOTEXGEN_AVX2_KERNELS
+static_assert(std::is_same<fpreal, float>::value,
+              "AVX2 kernels are written for single precision");
+#endif
+
+namespace
 {
-  // TODO: take caps as input
-  // Remove highlights and shadows
-  static const fpreal shadowCap(1.0_f / 255.0_f);
-  static const fpreal highlightCap(254.0_f / 255.0_f);
-  for (auto& pixel : io_image)
+// Remove highlights and shadows
+constexpr fpreal k_shadowCap    = 1.0_f / 255.0_f;
+constexpr fpreal k_highlightCap = 254.0_f / 255.0_f;
+
+// Each kernel processes whole blocks of eight pixels with AVX2 when it is
+// enabled, and finishes any remainder with the scalar code that makes up the
+// whole kernel otherwise, so the scalar path is built and run either way.
+void clampValues(fpreal* io_values,
+                 const uinteger _count,
+                 const fpreal _low,
+                 const fpreal _high) noexcept
+{
+  uinteger i = 0u;
+#ifdef AUTOTEXGEN_AVX2_KERNELS
+  const auto low  = _mm256_set1_ps(_low);
+  const auto high = _mm256_set1_ps(_high);
+  for (; i + 8u <= _count; i += 8u)
   {
-    pixel = glm::clamp(pixel, shadowCap, highlightCap);
+    auto v = _mm256_loadu_ps(io_values + i);
+    _mm256_storeu_ps(io_values + i, _mm256_min_ps(_mm256_max_ps(v, low), high));
   }
+#endif
+  for (; i < _count; ++i)
+    io_values[i] = glm::clamp(io_values[i], _low, _high);
 }
 
-void clampExtremeties(span<fpreal3> io_image)
+#ifdef AUTOTEXGEN_AVX2_KERNELS
+// Loads eight interleaved pixels and splits them into one register per channel
+inline void load8(const fpreal* _p,
+                  __m256& o_r,
+                  __m256& o_g,
+                  __m256& o_b) noexcept
 {
-  // TODO: take caps as input
-  // Remove highlights and shadows
-  static const fpreal3 shadowCap(1.0_f / 255.0_f);
-  static const fpreal3 highlightCap(254.0_f / 255.0_f);
-  for (auto& pixel : io_image)
+  // The low lanes hold pixels 0-3 and the high lanes pixels 4-7
+  auto m03 = _mm256_castps128_ps256(_mm_loadu_ps(_p));
+  auto m14 = _mm256_castps128_ps256(_mm_loadu_ps(_p + 4));
+  auto m25 = _mm256_castps128_ps256(_mm_loadu_ps(_p + 8));
+  m03      = _mm256_insertf128_ps(m03, _mm_loadu_ps(_p + 12), 1);
+  m14      = _mm256_insertf128_ps(m14, _mm_loadu_ps(_p + 16), 1);
+  m25      = _mm256_insertf128_ps(m25, _mm_loadu_ps(_p + 20), 1);
+  auto xy  = _mm256_shuffle_ps(m14, m25, _MM_SHUFFLE(2, 1, 3, 2));
+  auto yz  = _mm256_shuffle_ps(m03, m14, _MM_SHUFFLE(1, 0, 2, 1));
+  o_r      = _mm256_shuffle_ps(m03, xy, _MM_SHUFFLE(2, 0, 3, 0));
+  o_g      = _mm256_shuffle_ps(yz, xy, _MM_SHUFFLE(3, 1, 2, 0));
+  o_b      = _mm256_shuffle_ps(yz, m25, _MM_SHUFFLE(3, 0, 3, 1));
+}
+
+inline fpreal horizontalMax(const __m256 _v) noexcept
+{
+  auto m = _mm_max_ps(_mm256_castps256_ps128(_v), _mm256_extractf128_ps(_v, 1));
+  m      = _mm_max_ps(m, _mm_movehl_ps(m, m));
+  m      = _mm_max_ss(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 1, 1, 1)));
+  return _mm_cvtss_f32(m);
+}
+#endif
+
+// Clamps, then extracts intensity and chroma in registers, returning the
+// largest chroma seen merged with _max
+fpreal3 prepareKernel(const fpreal3* _image,
+                      fpreal* o_intensity,
+                      fpreal* o_r,
+                      fpreal* o_g,
+                      fpreal* o_b,
+                      const uinteger _count,
+                      fpreal3 _max) noexcept
+{
+  static constexpr fpreal third = 1.0_f / 3.0_f;
+  uinteger i = 0u;
+#ifdef AUTOTEXGEN_AVX2_KERNELS
+  const auto low    = _mm256_set1_ps(k_shadowCap);
+  const auto high   = _mm256_set1_ps(k_highlightCap);
+  const auto vthird = _mm256_set1_ps(third);
+  const auto three  = _mm256_set1_ps(3.0_f);
+  auto maxR         = _mm256_set1_ps(_max.x);
+  auto maxG         = _mm256_set1_ps(_max.y);
+  auto maxB         = _mm256_set1_ps(_max.z);
+  for (; i + 8u <= _count; i += 8u)
+  {
+    __m256 r, g, b;
+    load8(&_image[i].x, r, g, b);
+    r = _mm256_min_ps(_mm256_max_ps(r, low), high);
+    g = _mm256_min_ps(_mm256_max_ps(g, low), high);
+    b = _mm256_min_ps(_mm256_max_ps(b, low), high);
+    auto intensity =
+      _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(r, g), b), vthird);
+    auto cr = _mm256_div_ps(r, intensity);
+    auto cg = _mm256_div_ps(g, intensity);
+    auto cb = _mm256_sub_ps(_mm256_sub_ps(three, cr), cg);
+    _mm256_storeu_ps(o_intensity + i, intensity);
+    _mm256_storeu_ps(o_r + i, cr);
+    _mm256_storeu_ps(o_g + i, cg);
+    _mm256_storeu_ps(o_b + i, cb);
+    maxR = _mm256_max_ps(maxR, cr);
+    maxG = _mm256_max_ps(maxG, cg);
+    maxB = _mm256_max_ps(maxB, cb);
+  }
+  _max = fpreal3(horizontalMax(maxR), horizontalMax(maxG), horizontalMax(maxB));
+#endif
+  for (; i < _count; ++i)
   {
-    pixel = glm::clamp(pixel, shadowCap, highlightCap);
+    const auto pixel =
+      glm::clamp(_image[i], fpreal3(k_shadowCap), fpreal3(k_highlightCap));
+    o_intensity[i] = (pixel.x + pixel.y + pixel.z) * third;
+    o_r[i]         = pixel.x / o_intensity[i];
+    o_g[i]         = pixel.y / o_intensity[i];
+    o_b[i]         = 3.0_f - o_r[i] - o_g[i];
+    _max           = glm::max(_max, fpreal3(o_r[i], o_g[i], o_b[i]));
   }
+  return _max;
+}
+
+void scaleInterleaveKernel(const fpreal* _r,
+                           const fpreal* _g,
+                           const fpreal* _b,
+                           const fpreal* _scale,
+                           fpreal3* o_image,
+                           const uinteger _count) noexcept
+{
+  uinteger i = 0u;
+#ifdef AUTOTEXGEN_AVX2_KERNELS
+  for (; i + 8u <= _count; i += 8u)
+  {
+    auto scale = _mm256_loadu_ps(_scale + i);
+    auto x     = _mm256_mul_ps(_mm256_loadu_ps(_r + i), scale);
+    auto y     = _mm256_mul_ps(_mm256_loadu_ps(_g + i), scale);
+    auto z     = _mm256_mul_ps(_mm256_loadu_ps(_b + i), scale);
+    // Reverse of the shuffles in load8
+    auto rxy = _mm256_shuffle_ps(x, y, _MM_SHUFFLE(2, 0, 2, 0));
+    auto ryz = _mm256_shuffle_ps(y, z, _MM_SHUFFLE(3, 1, 3, 1));
+    auto rzx = _mm256_shuffle_ps(z, x, _MM_SHUFFLE(3, 1, 2, 0));
+    auto r03 = _mm256_shuffle_ps(rxy, rzx, _MM_SHUFFLE(2, 0, 2, 0));
+    auto r14 = _mm256_shuffle_ps(ryz, rxy, _MM_SHUFFLE(3, 1, 2, 0));
+    auto r25 = _mm256_shuffle_ps(rzx, ryz, _MM_SHUFFLE(3, 1, 3, 1));
+    fpreal* p = &o_image[i].x;
+    _mm_storeu_ps(p, _mm256_castps256_ps128(r03));
+    _mm_storeu_ps(p + 4, _mm256_castps256_ps128(r14));
+    _mm_storeu_ps(p + 8, _mm256_castps256_ps128(r25));
+    _mm_storeu_ps(p + 12, _mm256_extractf128_ps(r03, 1));
+    _mm_storeu_ps(p + 16, _mm256_extractf128_ps(r14, 1));
+    _mm_storeu_ps(p + 20, _mm256_extractf128_ps(r25, 1));
+  }
+#endif
+  for (; i < _count; ++i)
+  {
+    o_image[i] = fpreal3(_r[i], _g[i], _b[i]) * _scale[i];
+  }
+}
+}  // namespace
+
+void clampExtremeties(span<fpreal> io_image)
+{
+  // TODO: take caps as input
+  uinteger numPixels = io_image.size();
+  tbb::parallel_for(tbb::blocked_range<uinteger>{0u, numPixels},
+                    [&](auto&& r) {
+                      clampValues(io_image.data() + r.begin(),
+                                  r.size(),
+                                  k_shadowCap,
+                                  k_highlightCap);
+                    });
+}
+
+void clampExtremeties(span<fpreal3> io_image)
+{
+  // TODO: take caps as input
+  // Channels are clamped independently, so treat the image as a flat array
+  uinteger numPixels = io_image.size();
+  tbb::parallel_for(tbb::blocked_range<uinteger>{0u, numPixels},
+                    [&](auto&& r) {
+                      clampValues(&io_image[r.begin()].x,
+                                  r.size() * 3u,
+                                  k_shadowCap,
+                                  k_highlightCap);
+                    });
 }
 
 std::vector<fpreal> calculateIntensity(const span<fpreal3> _image)
@@ -69,4 +245,300 @@ std::vector<fpreal3> calculateChroma(const span<fpreal3> _sourceImage,
   return chroma;
 }
 
+void scaleToInterleaved(const PlanarImage3& _image,
+                        const span<fpreal> _scale,
+                        fpreal3* o_image)
+{
+  uinteger numPixels = _scale.size();
+  tbb::parallel_for(tbb::blocked_range<uinteger>{0u, numPixels},
+                    [&](auto&& r) {
+                      const auto begin = r.begin();
+                      scaleInterleaveKernel(
+                        _image.m_channels[0].data() + begin,
+                        _image.m_channels[1].data() + begin,
+                        _image.m_channels[2].data() + begin,
+                        _scale.data() + begin,
+                        o_image + begin,
+                        r.size());
+                    });
+}
+
+PreparedImage prepareImage(const span<fpreal3> _image)
+{
+  PreparedImage prepared;
+  prepareImage(_image, prepared);
+  return prepared;
+}
+
+void prepareImage(const span<fpreal3> _image, PreparedImage& o_prepared)
+{
+  uinteger numPixels = _image.size();
+  o_prepared.m_intensity.resize(numPixels);
+  for (auto& channel : o_prepared.m_chroma.m_channels)
+    channel.resize(numPixels);
+  auto& chroma           = o_prepared.m_chroma.m_channels;
+  o_prepared.m_maxChroma = tbb::parallel_reduce(
+    tbb::blocked_range<uinteger>{0u, numPixels},
+    fpreal3(0.0_f),
+    [&](auto&& r, fpreal3 maxChroma) {
+      const auto begin = r.begin();
+      return prepareKernel(_image.data() + begin,
+                           o_prepared.m_intensity.data() + begin,
+                           chroma[0].data() + begin,
+                           chroma[1].data() + begin,
+                           chroma[2].data() + begin,
+                           r.size(),
+                           maxChroma);
+    },
+    [](const fpreal3& a, const fpreal3& b) { return glm::max(a, b); });
+}
+
+std::vector<fpreal3> downsample(const span<fpreal3> _image,
+                                const uinteger2 _imageDim)
+{
+  const uinteger2 dim = (_imageDim + 1u) / 2u;
+  std::vector<fpreal3> result(dim.x * dim.y);
+  tbb::parallel_for(tbb::blocked_range<uinteger>{0u, dim.y}, [&](auto&& r) {
+    const auto end = r.end();
+    for (auto y = r.begin(); y < end; ++y)
+    {
+      const uinteger y0 = y * 2u;
+      const uinteger y1 = std::min(y0 + 1u, _imageDim.y - 1u);
+      for (uinteger x = 0u; x < dim.x; ++x)
+      {
+        const uinteger x0 = x * 2u;
+        const uinteger x1 = std::min(x0 + 1u, _imageDim.x - 1u);
+        result[y * dim.x + x] =
+          (_image[y0 * _imageDim.x + x0] + _image[y0 * _imageDim.x + x1] +
+           _image[y1 * _imageDim.x + x0] + _image[y1 * _imageDim.x + x1]) *
+          0.25_f;
+      }
+    }
+  });
+  return result;
+}
+
+std::vector<fpreal> resampleBilinear(const span<fpreal> _image,
+                                     const uinteger2 _imageDim,
+                                     const uinteger2 _newDim)
+{
+  const fpreal2 scale =
+    static_cast<fpreal2>(_imageDim) / static_cast<fpreal2>(_newDim);
+  const fpreal2 maxCoord = static_cast<fpreal2>(_imageDim) - 1.0_f;
+  std::vector<fpreal> result(_newDim.x * _newDim.y);
+  tbb::parallel_for(tbb::blocked_range<uinteger>{0u, _newDim.y}, [&](auto&& r) {
+    const auto end = r.end();
+    for (auto y = r.begin(); y < end; ++y)
+    {
+      const fpreal sy =
+        glm::clamp((y + 0.5_f) * scale.y - 0.5_f, 0.0_f, maxCoord.y);
+      const uinteger y0 = sy;
+      const uinteger y1 = std::min(y0 + 1u, _imageDim.y - 1u);
+      const fpreal ty   = sy - y0;
+      for (uinteger x = 0u; x < _newDim.x; ++x)
+      {
+        const fpreal sx =
+          glm::clamp((x + 0.5_f) * scale.x - 0.5_f, 0.0_f, maxCoord.x);
+        const uinteger x0 = sx;
+        const uinteger x1 = std::min(x0 + 1u, _imageDim.x - 1u);
+        const fpreal tx   = sx - x0;
+        const fpreal top    = glm::mix(_image[y0 * _imageDim.x + x0],
+                                       _image[y0 * _imageDim.x + x1],
+                                       tx);
+        const fpreal bottom = glm::mix(_image[y1 * _imageDim.x + x0],
+                                       _image[y1 * _imageDim.x + x1],
+                                       tx);
+        result[y * _newDim.x + x] = glm::mix(top, bottom, ty);
+      }
+    }
+  });
+  return result;
+}
+
+constexpr uinteger ImageReader::BAND_ROWS;
+constexpr uinteger ImageWriter::BAND_ROWS;
+
+ImageReader::ImageReader(const string_view _filename)
+  : m_input(OIIO::ImageInput::open(_filename.data())
+#if OIIO_VERSION >= 10900
+              .release()
+#endif
+              ,
+            [](auto ptr) {
+              ptr->close();
+              delete ptr;
+            })
+{
+  if (!m_input)
+    throw std::runtime_error("Could not open " + std::string(_filename.data()));
+}
+
+uinteger2 ImageReader::dimensions() const
+{
+  return {m_input->spec().width, m_input->spec().height};
+}
+
+void ImageReader::readRows(const uinteger _begin,
+                           const uinteger _end,
+                           const uinteger _numChannels,
+                           const OIIO::TypeDesc _format,
+                           const uinteger _pixelStride,
+                           void* o_data)
+{
+  const auto& spec     = m_input->spec();
+  const uinteger width = spec.width;
+  const int numChannels =
+    std::min(spec.nchannels, static_cast<int>(_numChannels));
+  bool success = true;
+  if (spec.tile_width > 0 && spec.tile_height > 0)
+  {
+    // The tile interface must be aligned to tile boundaries, so read the
+    // covering tiles and discard any extra rows
+    const uinteger tileHeight = spec.tile_height;
+    const uinteger tileBegin  = _begin - _begin % tileHeight;
+    const uinteger tileEnd    = std::min<uinteger>(
+      (_end + tileHeight - 1u) / tileHeight * tileHeight, spec.height);
+    const uinteger rowBytes = width * _pixelStride;
+    m_tileRows.resize(rowBytes * (tileEnd - tileBegin));
+    success = m_input->read_tiles(0,
+                                  spec.width,
+                                  tileBegin,
+                                  tileEnd,
+                                  0,
+                                  1,
+                                  0,
+                                  numChannels,
+                                  _format,
+                                  m_tileRows.data(),
+                                  _pixelStride);
+    std::memcpy(o_data,
+                m_tileRows.data() + (_begin - tileBegin) * rowBytes,
+                rowBytes * (_end - _begin));
+  }
+  else
+  {
+    success = m_input->read_scanlines(_begin,
+                                      _end,
+                                      0,
+                                      0,
+                                      numChannels,
+                                      _format,
+                                      o_data,
+                                      _pixelStride);
+  }
+  if (!success)
+    throw std::runtime_error(m_input->geterror());
+}
+
+ImageWriter::ImageWriter(const string_view _filename,
+                         const uinteger2 _imageDim,
+                         const uinteger _numChannels,
+                         const OIIO::TypeDesc _format)
+  : m_output(OIIO::ImageOutput::create(_filename.data())
+#if OIIO_VERSION >= 10900
+               .release()
+#endif
+               ,
+             [](auto ptr) {
+               ptr->close();
+               delete ptr;
+             })
+  , m_filename(_filename.data())
+{
+  OIIO::ImageSpec spec(_imageDim.x, _imageDim.y, _numChannels, _format);
+  if (!m_output || !m_output->open(m_filename, spec))
+    throw std::runtime_error("Could not create " + m_filename);
+}
+
+void ImageWriter::writeRows(const uinteger _begin,
+                            const uinteger _end,
+                            const OIIO::TypeDesc _format,
+                            const uinteger _pixelStride,
+                            const void* _data)
+{
+  if (!m_output->write_scanlines(_begin, _end, 0, _format, _data, _pixelStride))
+    throw std::runtime_error(m_output->geterror());
+}
+
+void ImageWriter::close()
+{
+  if (!m_output)
+    return;
+  // Release before closing, so a failure is not followed by a second close
+  std::unique_ptr<OIIO::ImageOutput> output(m_output.release());
+  if (!output->close())
+    throw std::runtime_error("Could not write " + m_filename + ": " +
+                             output->geterror());
+}
+
+AsyncImageWriter::AsyncImageWriter(const uinteger _numThreads)
+{
+  for (uinteger i = 0u; i < std::max(_numThreads, 1u); ++i)
+    m_threads.emplace_back([this] { run(); });
+}
+
+AsyncImageWriter::~AsyncImageWriter()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stopping = true;
+  }
+  m_queued.notify_all();
+  for (auto& thread : m_threads)
+    thread.join();
+}
+
+void AsyncImageWriter::push(const std::string& _filename,
+                            std::function<void()> _job)
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::cout << "Writing image to " << _filename << '\n';
+    m_jobs.push_back(std::move(_job));
+    ++m_outstanding;
+  }
+  m_queued.notify_one();
+}
+
+void AsyncImageWriter::flush()
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_idle.wait(lock, [this] { return !m_outstanding; });
+  if (m_error)
+    std::rethrow_exception(std::exchange(m_error, nullptr));
+}
+
+void AsyncImageWriter::run()
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+  while (true)
+  {
+    // Drain the queue before stopping, so no image is silently dropped
+    m_queued.wait(lock, [this] { return m_stopping || !m_jobs.empty(); });
+    if (m_jobs.empty())
+      return;
+    auto job = std::move(m_jobs.front());
+    m_jobs.pop_front();
+
+    lock.unlock();
+    std::exception_ptr error;
+    try
+    {
+      job();
+    }
+    catch (...)
+    {
+      error = std::current_exception();
+    }
+    // Release the buffer before reporting completion
+    job = nullptr;
+    lock.lock();
+
+    if (error && !m_error)
+      m_error = error;
+    if (!--m_outstanding)
+      m_idle.notify_all();
+  }
+}
+
 END_AUTOTEXGEN_NAMESPACE
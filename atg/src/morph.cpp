@@ -1,5 +1,10 @@
 #include "morph.h"
 
+#include <algorithm>
+#include <limits>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+
 BEGIN_AUTOTEXGEN_NAMESPACE
 
 namespace
@@ -9,13 +14,185 @@ uinteger2 computeBounds(uinteger _coord, uinteger _width, uinteger _cap)
   return {std::max(0, int(_coord) - int(_width)),
           std::min(_cap, _coord + _width)};
 }
-}  // namespace
 
-void erode(fpreal* _in,
-           fpreal* o_out,
-           uinteger2 _imageDim,
-           uinteger2 _structuringElement,
-           uinteger _iter)
+constexpr uint64_t k_allBits = ~uint64_t(0u);
+
+// Bits of the last word of a row that lie inside the image
+uint64_t lastWordBits(uinteger _width)
+{
+  return _width % 64u ? (uint64_t(1u) << (_width % 64u)) - 1u : k_allBits;
+}
+
+// Sets every pixel of a row, leaving the bits past its end clear
+void fillRow(uint64_t* o_row, uinteger _width, uinteger _rowWords)
+{
+  std::fill_n(o_row, _rowWords, k_allBits);
+  o_row[_rowWords - 1u] &= lastWordBits(_width);
+}
+
+// Finds the first pixel at or after _from whose bit equals _value, or _width
+// when there is none
+uinteger
+findBit(const uint64_t* _row, uinteger _from, uinteger _width, bool _value)
+{
+  const uinteger numWords = (_width + 63u) / 64u;
+  uinteger w              = _from / 64u;
+  if (w >= numWords)
+    return _width;
+  uint64_t word = (_value ? _row[w] : ~_row[w]) & (k_allBits << (_from % 64u));
+  while (!word)
+  {
+    if (++w == numWords)
+      return _width;
+    word = _value ? _row[w] : ~_row[w];
+  }
+  return std::min(_width, w * 64u + uinteger(__builtin_ctzll(word)));
+}
+
+// Clears the pixels [_begin, _end) of a row
+void clearBits(uint64_t* io_row, uinteger _begin, uinteger _end)
+{
+  while (_begin < _end)
+  {
+    const uinteger w    = _begin / 64u;
+    const uinteger lo   = _begin % 64u;
+    const uinteger hi   = std::min(_end - w * 64u, 64u);
+    const uint64_t bits = hi == 64u ? k_allBits : (uint64_t(1u) << hi) - 1u;
+    io_row[w] &= ~(bits & (k_allBits << lo));
+    _begin = w * 64u + hi;
+  }
+}
+
+// A zero at x clears the outputs whose window [x' - _half, x' + _half) holds
+// it, so each run of zeros [a, b) clears [a - _half + 1, b + _half)
+void erodeRows(const BitMask& _in, uinteger _half, BitMask& o_out)
+{
+  const uinteger width    = _in.m_dim.x;
+  const uinteger rowWords = _in.m_rowWords;
+  tbb::parallel_for(tbb::blocked_range<uinteger>{0u, _in.m_dim.y},
+                    [&](auto&& r) {
+                      const auto end = r.end();
+                      for (auto y = r.begin(); y < end; ++y)
+                      {
+                        const auto in = _in.m_words.data() + y * rowWords;
+                        auto out      = o_out.m_words.data() + y * rowWords;
+                        fillRow(out, width, rowWords);
+                        auto x = findBit(in, 0u, width, false);
+                        while (x < width)
+                        {
+                          const auto runEnd = findBit(in, x, width, true);
+                          clearBits(out,
+                                    x + 1u > _half ? x + 1u - _half : 0u,
+                                    std::min(width, runEnd + _half));
+                          x = findBit(in, runEnd, width, false);
+                        }
+                      }
+                    });
+}
+
+// van Herk/Gil-Werman running minimum over the rows [y - _half, y + _half).
+// The image is padded with _half rows of ones at either end and split into
+// blocks the length of the window, so every window spans the suffix of one
+// block and the prefix of the next.
+void erodeColumns(const BitMask& _in, uinteger _half, BitMask& o_out)
+{
+  const uinteger height    = _in.m_dim.y;
+  const uinteger rowWords  = _in.m_rowWords;
+  const uinteger window    = 2u * _half;
+  const uinteger numPadded = height + window;
+  const uinteger numBlocks = (numPadded + window - 1u) / window;
+
+  const std::vector<uint64_t> ones(rowWords, k_allBits);
+  const auto paddedRow = [&](uinteger _r) {
+    return _r < _half || _r >= _half + height
+             ? ones.data()
+             : _in.m_words.data() + (_r - _half) * rowWords;
+  };
+
+  std::vector<uint64_t> prefix(numPadded * rowWords);
+  std::vector<uint64_t> suffix(numPadded * rowWords);
+  tbb::parallel_for(
+    tbb::blocked_range<uinteger>{0u, numBlocks}, [&](auto&& r) {
+      const auto end = r.end();
+      for (auto b = r.begin(); b < end; ++b)
+      {
+        const auto first = b * window;
+        const auto last  = std::min(first + window, numPadded) - 1u;
+        std::copy_n(
+          paddedRow(first), rowWords, prefix.data() + first * rowWords);
+        for (auto row = first + 1u; row <= last; ++row)
+        {
+          const auto in   = paddedRow(row);
+          const auto prev = prefix.data() + (row - 1u) * rowWords;
+          auto out        = prefix.data() + row * rowWords;
+          for (uinteger w = 0u; w < rowWords; ++w)
+            out[w] = prev[w] & in[w];
+        }
+        std::copy_n(paddedRow(last), rowWords, suffix.data() + last * rowWords);
+        for (auto row = last; row-- > first;)
+        {
+          const auto in   = paddedRow(row);
+          const auto next = suffix.data() + (row + 1u) * rowWords;
+          auto out        = suffix.data() + row * rowWords;
+          for (uinteger w = 0u; w < rowWords; ++w)
+            out[w] = next[w] & in[w];
+        }
+      }
+    });
+
+  tbb::parallel_for(tbb::blocked_range<uinteger>{0u, height}, [&](auto&& r) {
+    const auto end = r.end();
+    for (auto y = r.begin(); y < end; ++y)
+    {
+      const auto s = suffix.data() + y * rowWords;
+      const auto p = prefix.data() + (y + window - 1u) * rowWords;
+      auto out     = o_out.m_words.data() + y * rowWords;
+      for (uinteger w = 0u; w < rowWords; ++w)
+        out[w] = s[w] & p[w];
+    }
+  });
+}
+
+constexpr uinteger k_unbounded = std::numeric_limits<uinteger>::max();
+
+// The smallest half extent h for which [x - h, x + h) covers a pixel at
+// offset _offset from x
+constexpr uinteger windowReach(integer _offset)
+{
+  return _offset < 0 ? uinteger(-_offset) : uinteger(_offset) + 1u;
+}
+
+// Walks the runs of equal labels along a row, calling _f(x, reach) for every
+// pixel, where reach is the smallest half extent whose window holds a different
+// label, or k_unbounded when the run spans the whole row
+template <typename F>
+void forEachRowReach(const uint8_t* _row, uinteger _width, F&& _f)
+{
+  uinteger begin = 0u;
+  while (begin < _width)
+  {
+    const auto label = _row[begin];
+    auto end         = begin + 1u;
+    while (end < _width && _row[end] == label)
+      ++end;
+    for (auto x = begin; x < end; ++x)
+    {
+      const auto left =
+        begin ? windowReach(integer(begin) - 1 - integer(x)) : k_unbounded;
+      const auto right =
+        end < _width ? windowReach(integer(end) - integer(x)) : k_unbounded;
+      _f(x, std::min(left, right));
+    }
+    begin = end;
+  }
+}
+
+// The product of every value in the window around each pixel
+void erodeProduct(fpreal* _in,
+                  fpreal* o_out,
+                  uinteger2 _imageDim,
+                  uinteger2 _structuringElement,
+                  uinteger _iter)
 {
   const uinteger2 kernelHalf =
     ((_structuringElement - uinteger2(1u)) * _iter) / 2u;
@@ -38,5 +215,179 @@ void erode(fpreal* _in,
     }
   }
 }
+}  // namespace
+
+void erode(fpreal* _in,
+           fpreal* o_out,
+           uinteger2 _imageDim,
+           uinteger2 _structuringElement,
+           uinteger _iter)
+{
+  const uinteger numPixels = _imageDim.x * _imageDim.y;
+  const bool binary =
+    std::all_of(_in, _in + numPixels, [](const fpreal _value) {
+      return _value == 0.0_f || _value == 1.0_f;
+    });
+  if (!binary)
+  {
+    erodeProduct(_in, o_out, _imageDim, _structuringElement, _iter);
+    return;
+  }
+
+  // Pack the mask, erode it a word at a time, and unpack the result
+  auto mask = makeBitMask(_imageDim);
+  tbb::parallel_for(
+    tbb::blocked_range<uinteger>{0u, _imageDim.y}, [&](auto&& r) {
+      const auto end = r.end();
+      for (auto y = r.begin(); y < end; ++y)
+      {
+        for (uinteger x = 0u; x < _imageDim.x; ++x)
+        {
+          if (_in[y * _imageDim.x + x] != 0.0_f)
+            setBit(mask, x, y);
+        }
+      }
+    });
+  BitMask eroded;
+  erode(mask, eroded, _structuringElement, _iter);
+  tbb::parallel_for(
+    tbb::blocked_range<uinteger>{0u, _imageDim.y}, [&](auto&& r) {
+      const auto end = r.end();
+      for (auto y = r.begin(); y < end; ++y)
+      {
+        for (uinteger x = 0u; x < _imageDim.x; ++x)
+        {
+          o_out[y * _imageDim.x + x] = testBit(eroded, x, y) ? 1.0_f : 0.0_f;
+        }
+      }
+    });
+}
+
+BitMask makeBitMask(uinteger2 _dim)
+{
+  BitMask mask;
+  mask.m_dim      = _dim;
+  mask.m_rowWords = (_dim.x + 63u) / 64u;
+  mask.m_words.resize(mask.m_rowWords * _dim.y);
+  return mask;
+}
+
+void erode(const BitMask& _in,
+           BitMask& o_out,
+           uinteger2 _structuringElement,
+           uinteger _iter)
+{
+  const uinteger2 kernelHalf =
+    ((_structuringElement - uinteger2(1u)) * _iter) / 2u;
+  if (o_out.m_dim != _in.m_dim)
+    o_out = makeBitMask(_in.m_dim);
+  if (!_in.m_rowWords)
+    return;
+
+  // An empty window leaves every pixel set, as erode takes the product over
+  // no values
+  if (!kernelHalf.x || !kernelHalf.y)
+  {
+    for (uinteger y = 0u; y < _in.m_dim.y; ++y)
+    {
+      fillRow(o_out.m_words.data() + y * _in.m_rowWords,
+              _in.m_dim.x,
+              _in.m_rowWords);
+    }
+    return;
+  }
+
+  auto rows = makeBitMask(_in.m_dim);
+  erodeRows(_in, kernelHalf.x, rows);
+  erodeColumns(rows, kernelHalf.y, o_out);
+}
+
+void erodeLabels(const span<const uint8_t> _labels,
+                 uinteger2 _imageDim,
+                 const span<const uinteger2> _kernelHalves,
+                 uint8_t _excluded,
+                 uint8_t* o_labels)
+{
+  const uinteger width     = _imageDim.x;
+  const uinteger height    = _imageDim.y;
+  const uinteger numPixels = width * height;
+
+  // A window that is empty along either axis leaves its label uneroded, as
+  // zero extents along both axes are exceeded by every reach
+  std::vector<uinteger2> halves(_kernelHalves.begin(), _kernelHalves.end());
+  for (auto& half : halves)
+  {
+    if (!half.x || !half.y)
+      half = uinteger2(0u);
+  }
+
+  // A pixel survives when every pixel of its box shares its label. Along the
+  // rows, keep the pixels whose row window holds only their own label.
+  std::vector<uint8_t> rowEroded(numPixels);
+  tbb::parallel_for(
+    tbb::blocked_range<uinteger>{0u, height}, [&](auto&& r) {
+      const auto end = r.end();
+      for (auto y = r.begin(); y < end; ++y)
+      {
+        const auto row = _labels.data() + y * width;
+        auto out       = rowEroded.data() + y * width;
+        forEachRowReach(row, width, [&](uinteger x, uinteger reach) {
+          const auto label = row[x];
+          const bool keep  = label != _excluded && reach > halves[label].x;
+          out[x]           = keep ? label : _excluded;
+        });
+      }
+    });
+
+  // Down the columns, keep the pixels whose column window holds only row
+  // survivors of their own label. Sweep the distance to the closest different
+  // value above each pixel, then combine it with the one below on the way
+  // back, both in row order so that whole rows are processed together.
+  std::vector<uinteger> above(numPixels);
+  tbb::parallel_for(
+    tbb::blocked_range<uinteger>{0u, width}, [&](auto&& r) {
+      const auto begin = r.begin();
+      const auto end   = r.end();
+      for (auto x = begin; x < end; ++x)
+        above[x] = k_unbounded;
+      for (uinteger y = 1u; y < height; ++y)
+      {
+        const auto cur  = rowEroded.data() + y * width;
+        const auto prev = cur - width;
+        for (auto x = begin; x < end; ++x)
+        {
+          auto reach = above[(y - 1u) * width + x];
+          if (cur[x] != prev[x])
+            reach = 1u;
+          else if (reach != k_unbounded)
+            ++reach;
+          above[y * width + x] = reach;
+        }
+      }
+
+      std::vector<uinteger> below(end - begin, k_unbounded);
+      for (auto y = height; y-- > 0u;)
+      {
+        const auto cur = rowEroded.data() + y * width;
+        auto out       = o_labels + y * width;
+        for (auto x = begin; x < end; ++x)
+        {
+          auto& reach = below[x - begin];
+          if (y + 1u < height)
+          {
+            if (cur[x] != cur[x + width])
+              reach = 2u;
+            else if (reach != k_unbounded)
+              ++reach;
+          }
+          const auto label = cur[x];
+          const bool keep  = label != _excluded &&
+                            std::min(above[y * width + x], reach) >
+                              halves[label].y;
+          out[x] = keep ? label : _excluded;
+        }
+      }
+    });
+}
 
 END_AUTOTEXGEN_NAMESPACE
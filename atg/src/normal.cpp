@@ -1,6 +1,11 @@
 #include "normal.h"
 #include <algorithm>
+#include <cmath>
+#include <functional>
 #include <numeric>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_reduce.h>
 #include <glm/gtx/fast_square_root.hpp>
 #include <glm/matrix.hpp>
 #include "glm/gtx/string_cast.hpp"
@@ -8,7 +13,11 @@
 
 BEGIN_AUTOTEXGEN_NAMESPACE
 
-std::vector<fpreal3> computeRelativeNormals(const_span<fpreal> _shading, const fpreal3 _lightDirection)
+std::vector<fpreal3> computeRelativeNormals(const_span<fpreal> _shading,
+                                            const fpreal3 _lightDirection,
+                                            const uinteger _maxIterations,
+                                            const fpreal _tolerance,
+                                            const fpreal3* _initialNormals)
 {
   const auto L = glm::normalize(_lightDirection);
   const uinteger numNormals = _shading.size();
@@ -17,6 +26,9 @@ std::vector<fpreal3> computeRelativeNormals(const_span<fpreal> _shading, const f
 
   std::vector<fpreal3> Nk(numNormals, {0._f, 0._f, 0._f});
   std::vector<fpreal3> Nk1(numNormals);
+  // Warm start from a previous solution when provided
+  if (_initialNormals)
+    std::copy_n(_initialNormals, numNormals, Nk.begin());
 
   // Compute the self outer product of L 
   auto Q = glm::outerProduct(L, L);
@@ -35,45 +47,82 @@ std::vector<fpreal3> computeRelativeNormals(const_span<fpreal> _shading, const f
   aDiag = 1._f / aDiag;
 
 
-  for (uinteger iter = 0u; iter < 25u; ++iter)
+  uinteger iter = 0u;
+  while (iter < _maxIterations)
   {
-    auto Nsum = std::accumulate(Nk.begin(), Nk.end(), fpreal3(0.0_f));
-    for (uinteger i = 0u; i < numNormals; ++i)
-    {
-      // b is 2*Si*L
-      fpreal3 b = 2._f * _shading[i] * L;
-
-      // Subtract this x, y, z from total, add our scaled comps
-      fpreal3 rowSum = (Nsum - Nk[i]) * -twoLambda + Nk[i] * Q;
-      // Compute the next N
-      Nk1[i] = aDiag * (b + rowSum);
-      // Clamp Z to positive to ensure convergence
-      Nk1[i].z = std::abs(Nk1[i].z);
-      // Normalize our result
-      Nk1[i] = glm::normalize(Nk1[i]);
-    }
+    ++iter;
+    // Each normal only depends on the others through their sum
+    const auto Nsum = tbb::parallel_reduce(
+      tbb::blocked_range<uinteger>{0u, numNormals},
+      fpreal3(0.0_f),
+      [&](auto&& r, fpreal3 sum) {
+        const auto end = r.end();
+        for (auto i = r.begin(); i < end; ++i)
+          sum += Nk[i];
+        return sum;
+      },
+      std::plus<fpreal3>());
+    // Largest distance any normal moved this pass
+    const auto residual = tbb::parallel_reduce(
+      tbb::blocked_range<uinteger>{0u, numNormals},
+      0.0_f,
+      [&](auto&& r, fpreal maxDistance) {
+        const auto end = r.end();
+        for (auto i = r.begin(); i < end; ++i)
+        {
+          // b is 2*Si*L
+          fpreal3 b = 2._f * _shading[i] * L;
+
+          // Subtract this x, y, z from total, add our scaled comps
+          fpreal3 rowSum = (Nsum - Nk[i]) * -twoLambda + Nk[i] * Q;
+          // Compute the next N
+          Nk1[i] = aDiag * (b + rowSum);
+          // Clamp Z to positive to ensure convergence
+          Nk1[i].z = std::abs(Nk1[i].z);
+          // Normalize our result
+          Nk1[i]      = glm::normalize(Nk1[i]);
+          maxDistance = std::max(maxDistance, glm::distance(Nk1[i], Nk[i]));
+        }
+        return maxDistance;
+      },
+      [](fpreal a, fpreal b) { return std::max(a, b); });
     std::swap(Nk1, Nk);
+    if (residual <= _tolerance)
+      break;
   }
+  std::cout << "Relative normals computed in " << iter << " iterations.\n";
   return Nk;
 }
 
-fpreal solveH(const fpreal2& _N1, const fpreal2& _N2)
+namespace
 {
-  // cc Karo 2018
-  auto N1 = glm::fastNormalize(_N1);
-  auto N2 = glm::fastNormalize(_N2);
-
-  auto theta = glm::angle(N1, N2);
-  auto gamma = (glm::pi<fpreal>() - theta) * 0.5_f;
-  auto delta = std::abs(glm::angle({1.0_f, 0.0_f}, N1));
-  delta = std::abs(std::atan(N1.y/N1.x));
-
-  auto alpha = gamma - delta;
-  auto beta  = glm::half_pi<fpreal>() - alpha;
+// Relative height between two normals projected onto a plane, (x1, y1) and
+// (x2, y2), neither need be normalised. solveH used to find this through
+// angles (cc Karo 2018):
+//   gamma = (pi - theta) / 2, delta = |atan(y1 / x1)|, h = tan(gamma - delta)
+// where theta is the angle between the normals. Expanding with tan(gamma) =
+// (1 + cos(theta)) / sin(theta) and tan(delta) = |y1| / |x1| gives the same
+// geometry with a single square root.
+inline fpreal relativeHeight(const fpreal _x1,
+                             const fpreal _y1,
+                             const fpreal _x2,
+                             const fpreal _y2) noexcept
+{
+  const fpreal lengths =
+    std::sqrt((_x1 * _x1 + _y1 * _y1) * (_x2 * _x2 + _y2 * _y2));
+  // |N1||N2| (1 + cos(theta)) and |N1||N2| sin(theta)
+  const fpreal cosine = lengths + _x1 * _x2 + _y1 * _y2;
+  const fpreal sine   = std::abs(_x1 * _y2 - _y1 * _x2);
+  const fpreal ax     = std::abs(_x1);
+  const fpreal ay     = std::abs(_y1);
+  const fpreal h      = (cosine * ax - sine * ay) / (sine * ax + cosine * ay);
+  return (_x1 > 0.0_f && _x2 < 0.0_f) ? -h : h;
+}
+}  // namespace
 
-  fpreal h = std::sin(alpha) / std::sin(beta);
-  if (N1.x > 0.0 && N2.x < 0.0) h = -h;
-  return h;
+fpreal solveH(const fpreal2& _N1, const fpreal2& _N2)
+{
+  return relativeHeight(_N1.x, _N1.y, _N2.x, _N2.y);
 }
 
 fpreal solveHG(const fpreal2& _N1, const fpreal2& _N2)
@@ -105,30 +154,37 @@ std::vector<fpreal2> computeRelativeHeights(fpreal3* _normals, uinteger2 _imageD
   std::vector<fpreal2> relativeHeights(_imageDim.x * _imageDim.y);
 
   // Iterate over all except last row and column, as they will have no,
-  // neighbours to store a relative height for.
-  for (uinteger y = 0u; y < _imageDim.y - 1u; ++y)
-  {
-    for (uinteger x = 0u; x < _imageDim.x - 1u; ++x)
-    {
-      // Current normal
-      auto& N00 = _normals[y * _imageDim.x + x];
-      // Neighbour to the right
-      auto& N10 = _normals[y * _imageDim.x + x + 1];
-      // Neighbour below
-      auto& N01 = _normals[(y + 1u) * _imageDim.x + x];
-
-      // Solve the x relative height using normals projected onto xz plane,
-      // and y relative height with projection onto yz plane
-      auto& rh = relativeHeights[y * _imageDim.x + x];
-      rh.x = solveH({N00.x, N00.z}, {N10.x, N10.z});
-      rh.y = solveH({N00.y, N00.z}, {N01.y, N01.z});
-    }
-  }
+  // neighbours to store a relative height for. Rows are independent, and
+  // each row is vectorised across pixels.
+  const uinteger width = _imageDim.x - 1u;
+  tbb::parallel_for(
+    tbb::blocked_range<uinteger>{0u, _imageDim.y - 1u}, [&](auto&& r) {
+      const auto end = r.end();
+      for (auto y = r.begin(); y < end; ++y)
+      {
+        // Current row, row below and output
+        const fpreal3* N0 = _normals + y * _imageDim.x;
+        const fpreal3* N1 = N0 + _imageDim.x;
+        fpreal2* rh       = relativeHeights.data() + y * _imageDim.x;
+#pragma omp simd
+        for (uinteger x = 0u; x < width; ++x)
+        {
+          // Solve the x relative height using normals projected onto xz
+          // plane, and y relative height with projection onto yz plane
+          rh[x].x =
+            relativeHeight(N0[x].x, N0[x].z, N0[x + 1u].x, N0[x + 1u].z);
+          rh[x].y = relativeHeight(N0[x].y, N0[x].z, N1[x].y, N1[x].z);
+        }
+      }
+    });
 
   return relativeHeights;
 }
 
-std::vector<fpreal> computeAbsoluteHeights(fpreal2* _relativeHeights, uinteger2 _imageDim)
+namespace
+{
+std::vector<fpreal> jacobiHeights(const fpreal2* _relativeHeights,
+                                  uinteger2 _imageDim)
 {
   const uinteger numHeights = _imageDim.x * _imageDim.y;
   std::vector<fpreal> HK(numHeights);
@@ -171,10 +227,287 @@ std::vector<fpreal> computeAbsoluteHeights(fpreal2* _relativeHeights, uinteger2
   }
   std::swap(HK, HK1);
   }
+  return HK;
+}
+
+// One level of the multigrid hierarchy. Each height is linked to its right and
+// lower neighbours by edges weighted m_wx and m_wy, with a zero weight where
+// there is no neighbour. m_diag holds the total weight of each height's edges.
+struct GridLevel
+{
+  uinteger2 m_dim;
+  std::vector<fpreal> m_wx;
+  std::vector<fpreal> m_wy;
+  std::vector<fpreal> m_diag;
+  std::vector<fpreal> m_h;
+  std::vector<fpreal> m_b;
+  std::vector<fpreal> m_r;
+};
+
+void resizeLevel(GridLevel& io_level, const uinteger2 _dim)
+{
+  const uinteger numHeights = _dim.x * _dim.y;
+  io_level.m_dim            = _dim;
+  io_level.m_wx.assign(numHeights, 0.0_f);
+  io_level.m_wy.assign(numHeights, 0.0_f);
+  io_level.m_diag.assign(numHeights, 0.0_f);
+  io_level.m_h.assign(numHeights, 0.0_f);
+  io_level.m_b.assign(numHeights, 0.0_f);
+  io_level.m_r.assign(numHeights, 0.0_f);
+}
+
+void calculateDiagonal(GridLevel& io_level)
+{
+  const auto dim = io_level.m_dim;
+  tbb::parallel_for(tbb::blocked_range<uinteger>{0u, dim.y}, [&](auto&& r) {
+    const auto end = r.end();
+    for (auto y = r.begin(); y < end; ++y)
+      for (uinteger x = 0u; x < dim.x; ++x)
+      {
+        const uinteger i = y * dim.x + x;
+        fpreal diag      = io_level.m_wx[i] + io_level.m_wy[i];
+        if (x)
+          diag += io_level.m_wx[i - 1u];
+        if (y)
+          diag += io_level.m_wy[i - dim.x];
+        io_level.m_diag[i] = diag;
+      }
+  });
+}
+
+// Sum of the weighted neighbouring heights, the off diagonal part of A * h
+inline fpreal neighbourSum(const GridLevel& _level,
+                           const uinteger _x,
+                           const uinteger _y) noexcept
+{
+  const auto dim   = _level.m_dim;
+  const uinteger i = _y * dim.x + _x;
+  const auto& h    = _level.m_h;
+  fpreal sum       = 0.0_f;
+  if (_x)
+    sum += _level.m_wx[i - 1u] * h[i - 1u];
+  if (_x + 1u < dim.x)
+    sum += _level.m_wx[i] * h[i + 1u];
+  if (_y)
+    sum += _level.m_wy[i - dim.x] * h[i - dim.x];
+  if (_y + 1u < dim.y)
+    sum += _level.m_wy[i] * h[i + dim.x];
+  return sum;
+}
+
+// Red-black Gauss-Seidel, heights of one colour only depend on those of the
+// other, so each half sweep is run in parallel
+void smooth(GridLevel& io_level, const uinteger _sweeps)
+{
+  const auto dim = io_level.m_dim;
+  for (uinteger sweep = 0u; sweep < _sweeps; ++sweep)
+    for (uinteger colour = 0u; colour < 2u; ++colour)
+    {
+      tbb::parallel_for(
+        tbb::blocked_range<uinteger>{0u, dim.y}, [&](auto&& r) {
+          const auto end = r.end();
+          for (auto y = r.begin(); y < end; ++y)
+            for (uinteger x = (y + colour) & 1u; x < dim.x; x += 2u)
+            {
+              const uinteger i = y * dim.x + x;
+              if (io_level.m_diag[i] == 0.0_f)
+                continue;
+              const auto sum = io_level.m_b[i] + neighbourSum(io_level, x, y);
+              io_level.m_h[i] = sum / io_level.m_diag[i];
+            }
+        });
+    }
+}
+
+// Computes r = b - A * h, returning the squared norm of r
+double calculateResidual(GridLevel& io_level)
+{
+  const auto dim = io_level.m_dim;
+  return tbb::parallel_reduce(
+    tbb::blocked_range<uinteger>{0u, dim.y},
+    0.0,
+    [&](auto&& r, double sum) {
+      const auto end = r.end();
+      for (auto y = r.begin(); y < end; ++y)
+        for (uinteger x = 0u; x < dim.x; ++x)
+        {
+          const uinteger i = y * dim.x + x;
+          const auto residual =
+            io_level.m_b[i] + neighbourSum(io_level, x, y) -
+            io_level.m_diag[i] * io_level.m_h[i];
+          io_level.m_r[i] = residual;
+          sum += residual * residual;
+        }
+      return sum;
+    },
+    std::plus<double>());
+}
+
+// Heights are aggregated in 2x2 blocks. The coarse operator is the Galerkin
+// product P^T A P for piecewise constant P, so a coarse edge has the summed
+// weight of every fine edge joining its two blocks.
+void coarsen(const GridLevel& _fine, GridLevel& o_coarse)
+{
+  const auto fdim = _fine.m_dim;
+  resizeLevel(o_coarse, (fdim + 1u) / 2u);
+  const auto cdim = o_coarse.m_dim;
+  tbb::parallel_for(tbb::blocked_range<uinteger>{0u, cdim.y}, [&](auto&& r) {
+    const auto end = r.end();
+    for (auto y = r.begin(); y < end; ++y)
+      for (uinteger x = 0u; x < cdim.x; ++x)
+      {
+        const uinteger i = y * cdim.x + x;
+        for (uinteger k = 0u; k < 2u; ++k)
+        {
+          // Edges leaving the right and bottom sides of the block
+          const uinteger2 right{2u * x + 1u, 2u * y + k};
+          if (right.x + 1u < fdim.x && right.y < fdim.y)
+            o_coarse.m_wx[i] += _fine.m_wx[right.y * fdim.x + right.x];
+          const uinteger2 below{2u * x + k, 2u * y + 1u};
+          if (below.y + 1u < fdim.y && below.x < fdim.x)
+            o_coarse.m_wy[i] += _fine.m_wy[below.y * fdim.x + below.x];
+        }
+      }
+  });
+  calculateDiagonal(o_coarse);
+}
+
+// Piecewise constant interpolation underestimates the smooth error, so the
+// coarse correction is scaled up
+constexpr fpreal k_overCorrection    = 1.8_f;
+constexpr uinteger k_smoothingSweeps = 2u;
+constexpr uinteger k_coarsestSweeps  = 64u;
+
+// One W-cycle from _level down, each coarse level is visited twice per visit
+// of the level above it
+void wcycle(std::vector<GridLevel>& io_levels, const uinteger _level)
+{
+  auto& fine = io_levels[_level];
+  if (_level + 1u == io_levels.size())
+  {
+    smooth(fine, k_coarsestSweeps);
+    return;
+  }
+  smooth(fine, k_smoothingSweeps);
+  calculateResidual(fine);
+
+  // Restrict the residual onto the coarse level, and solve for its error
+  auto& coarse    = io_levels[_level + 1u];
+  const auto fdim = fine.m_dim;
+  const auto cdim = coarse.m_dim;
+  tbb::parallel_for(tbb::blocked_range<uinteger>{0u, cdim.y}, [&](auto&& r) {
+    const auto end = r.end();
+    for (auto y = r.begin(); y < end; ++y)
+      for (uinteger x = 0u; x < cdim.x; ++x)
+      {
+        fpreal sum = 0.0_f;
+        for (uinteger fy = 2u * y; fy < std::min(2u * y + 2u, fdim.y); ++fy)
+          for (uinteger fx = 2u * x; fx < std::min(2u * x + 2u, fdim.x); ++fx)
+            sum += fine.m_r[fy * fdim.x + fx];
+        coarse.m_b[y * cdim.x + x] = sum;
+      }
+  });
+  std::fill(coarse.m_h.begin(), coarse.m_h.end(), 0.0_f);
+  // Visiting the coarse levels twice makes up for the weak interpolation, the
+  // coarsest level is solved outright so once is enough there
+  wcycle(io_levels, _level + 1u);
+  if (_level + 2u < io_levels.size())
+    wcycle(io_levels, _level + 1u);
+
+  // Interpolate the correction back up
+  tbb::parallel_for(tbb::blocked_range<uinteger>{0u, fdim.y}, [&](auto&& r) {
+    const auto end = r.end();
+    for (auto y = r.begin(); y < end; ++y)
+      for (uinteger x = 0u; x < fdim.x; ++x)
+      {
+        fine.m_h[y * fdim.x + x] +=
+          k_overCorrection * coarse.m_h[(y / 2u) * cdim.x + x / 2u];
+      }
+  });
+  smooth(fine, k_smoothingSweeps);
+}
+
+// Least squares fit of heights to the relative heights, h(x + 1) - h(x) =
+// rh.x and h(y + 1) - h(y) = rh.y, solved with multigrid W-cycles
+std::vector<fpreal> multigridHeights(const fpreal2* _relativeHeights,
+                                     const uinteger2 _imageDim,
+                                     const fpreal _tolerance,
+                                     const uinteger _maxCycles)
+{
+  // Build the finest level from the relative heights
+  GridLevel finest;
+  resizeLevel(finest, _imageDim);
+  for (uinteger y = 0u; y < _imageDim.y; ++y)
+    for (uinteger x = 0u; x < _imageDim.x; ++x)
+    {
+      const uinteger i = y * _imageDim.x + x;
+      const auto rh    = _relativeHeights[i];
+      if (x + 1u < _imageDim.x)
+      {
+        finest.m_wx[i] = 1.0_f;
+        finest.m_b[i] -= rh.x;
+        finest.m_b[i + 1u] += rh.x;
+      }
+      if (y + 1u < _imageDim.y)
+      {
+        finest.m_wy[i] = 1.0_f;
+        finest.m_b[i] -= rh.y;
+        finest.m_b[i + _imageDim.x] += rh.y;
+      }
+    }
+  calculateDiagonal(finest);
+
+  // A zero right hand side is solved by flat heights, and would leave the
+  // relative residual below undefined
+  const double bNorm = std::sqrt(std::inner_product(
+    finest.m_b.begin(), finest.m_b.end(), finest.m_b.begin(), 0.0));
+  if (bNorm == 0.0)
+    return std::move(finest.m_h);
+
+  // Coarsen until the grid is small enough to solve directly by smoothing
+  static constexpr uinteger coarsestSize = 4u;
+  std::vector<GridLevel> levels;
+  levels.push_back(std::move(finest));
+  while (levels.back().m_dim.x > coarsestSize ||
+         levels.back().m_dim.y > coarsestSize)
+  {
+    GridLevel coarse;
+    coarsen(levels.back(), coarse);
+    levels.push_back(std::move(coarse));
+  }
+  auto& fine = levels.front();
+
+  uinteger cycle = 0u;
+  double relativeResidual = 0.0;
+  while (cycle < _maxCycles)
+  {
+    ++cycle;
+    wcycle(levels, 0u);
+    relativeResidual = std::sqrt(calculateResidual(fine)) / bNorm;
+    if (relativeResidual <= _tolerance)
+      break;
+  }
+  std::cout << "Multigrid converged to " << relativeResidual << " in " << cycle
+            << " cycles over " << levels.size() << " levels.\n";
+  return std::move(fine.m_h);
+}
+}  // namespace
+
+std::vector<fpreal> computeAbsoluteHeights(fpreal2* _relativeHeights,
+                                           uinteger2 _imageDim,
+                                           const HeightSolver _solver,
+                                           const fpreal _tolerance,
+                                           const uinteger _maxCycles)
+{
+  auto HK = _solver == HeightSolver::MULTIGRID
+              ? multigridHeights(
+                  _relativeHeights, _imageDim, _tolerance, _maxCycles)
+              : jacobiHeights(_relativeHeights, _imageDim);
   //std::transform(HK.begin(), HK.end(), HK.begin(), [&](auto h) { return -std::move(h); });
   auto max = *std::max_element(HK.begin(), HK.end());
   auto min = *std::min_element(HK.begin(), HK.end());
-  auto invRange = 1._f / (max - min);
+  // Flat heights have no range to normalise, leave them at zero
+  auto invRange = max > min ? 1._f / (max - min) : 0._f;
   std::cout<<"inf: "<<max<<' '<<min<<' '<<invRange<<'\n';
   std::transform(HK.begin(), HK.end(), HK.begin(), [&](auto h) { return (std::move(h) - min) * invRange; });
 
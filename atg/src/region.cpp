@@ -16,8 +16,8 @@ RegionData generateRegions(const uinteger2 _imageDim,
   // Allocate storage for the regions
   r.m_regions = std::make_unique<Region[]>(totalNumRegions);
 
-  for (uinteger x = 0u; x < r.m_numRegions.x; ++x)
-    for (uinteger y = 0u; y < r.m_numRegions.y; ++y)
+  for (uinteger y = 0u; y < r.m_numRegions.y; ++y)
+    for (uinteger x = 0u; x < r.m_numRegions.x; ++x)
     {
       // Construct our region
       auto& region = r.m_regions[y * r.m_numRegions.x + x];
@@ -6,13 +6,127 @@
 #include <glm/common.hpp>
 #include <glm/gtx/extended_min_max.hpp>
 
-#include <alloca.h>
+#include <algorithm>
+#include <cassert>
 #include <numeric>
+#include <stdexcept>
 #include <tbb/blocked_range.h>
+#include <tbb/enumerable_thread_specific.h>
 #include <tbb/parallel_for.h>
+#include <tbb/parallel_reduce.h>
+#include <tbb/task_group.h>
 
 BEGIN_AUTOTEXGEN_NAMESPACE
 
+namespace
+{
+// Upper bound on the region estimates held at once, 16MB of values
+constexpr uinteger k_maxRowEstimates = 1u << 22u;
+
+void resetPalette(ChromaPalette& io_palette, const uinteger _numIds)
+{
+  io_palette.m_counts.assign(_numIds, 0u);
+  io_palette.m_index.resize(_numIds);
+  io_palette.m_free.clear();
+  io_palette.m_size = 0u;
+}
+
+void addPaletteRow(ChromaPalette& io_palette,
+                   const ChromaId* _row,
+                   const uinteger _width)
+{
+  for (uinteger x = 0u; x < _width; ++x)
+  {
+    if (io_palette.m_counts[_row[x]]++)
+      continue;
+    if (io_palette.m_free.empty())
+    {
+      io_palette.m_index[_row[x]] = io_palette.m_size++;
+    }
+    else
+    {
+      io_palette.m_index[_row[x]] = io_palette.m_free.back();
+      io_palette.m_free.pop_back();
+    }
+  }
+}
+
+void removePaletteRow(ChromaPalette& io_palette,
+                      const ChromaId* _row,
+                      const uinteger _width)
+{
+  for (uinteger x = 0u; x < _width; ++x)
+  {
+    if (!--io_palette.m_counts[_row[x]])
+      io_palette.m_free.push_back(io_palette.m_index[_row[x]]);
+  }
+}
+
+void addSample(ChromaHistogram& io_histogram,
+               const uinteger _slot,
+               const fpreal _intensity) noexcept
+{
+  if (!io_histogram.m_counts[_slot]++)
+  {
+    io_histogram.m_position[_slot] = io_histogram.m_numOccupied;
+    io_histogram.m_occupied[io_histogram.m_numOccupied++] = _slot;
+  }
+  io_histogram.m_intensitySums[_slot] += _intensity;
+}
+
+void removeSample(ChromaHistogram& io_histogram,
+                  const uinteger _slot,
+                  const fpreal _intensity) noexcept
+{
+  io_histogram.m_intensitySums[_slot] -= _intensity;
+  if (!--io_histogram.m_counts[_slot])
+  {
+    // Move the last occupied slot into the position of the removed one
+    auto last = io_histogram.m_occupied[--io_histogram.m_numOccupied];
+    io_histogram.m_occupied[io_histogram.m_position[_slot]] = last;
+    io_histogram.m_position[last] = io_histogram.m_position[_slot];
+    io_histogram.m_intensitySums[_slot] = 0.0;
+  }
+}
+
+void clearHistogram(ChromaHistogram& io_histogram) noexcept
+{
+  for (uinteger i = 0u; i < io_histogram.m_numOccupied; ++i)
+  {
+    auto slot = io_histogram.m_occupied[i];
+    io_histogram.m_intensitySums[slot] = 0.0;
+    io_histogram.m_counts[slot]        = 0u;
+  }
+  io_histogram.m_numOccupied = 0u;
+}
+
+void writeEstimates(const ChromaHistogram& _histogram,
+                    fpreal* io_estimatedAlbedoIntensity,
+                    const fpreal _shadingIntensityAverage) noexcept
+{
+  for (uinteger i = 0u; i < _histogram.m_numOccupied; ++i)
+  {
+    auto slot = _histogram.m_occupied[i];
+    io_estimatedAlbedoIntensity[slot] =
+      _histogram.m_intensitySums[slot] /
+      (_histogram.m_counts[slot] * _shadingIntensityAverage);
+  }
+}
+
+}  // namespace
+
+void resizeHistogram(ChromaHistogram& io_histogram,
+                     const uinteger _paletteSize)
+{
+  // Unoccupied entries are always zero, so existing data can be kept
+  if (_paletteSize <= io_histogram.m_counts.size())
+    return;
+  io_histogram.m_intensitySums.resize(_paletteSize, 0.0);
+  io_histogram.m_counts.resize(_paletteSize, 0u);
+  io_histogram.m_occupied.resize(_paletteSize);
+  io_histogram.m_position.resize(_paletteSize);
+}
+
 // Define our hashing algorithm as quantization of r and g into slots,
 // to give slots^2 possible chroma values
 uinteger hashChroma(const fpreal3 _chroma,
@@ -28,28 +142,45 @@ uinteger hashChroma(const fpreal3 _chroma,
   return y * last + x;
 }
 
+void calculateChromaIds(const PlanarImage3& _chroma,
+                        const fpreal3 _maxChroma,
+                        const uinteger _slots,
+                        ChromaId* o_chromaIds)
+{
+  assert(_slots <= MAX_CHROMA_SLOTS);
+  const auto& r = _chroma.m_channels[0];
+  const auto& g = _chroma.m_channels[1];
+  uinteger numPixels = r.size();
+  tbb::parallel_for(tbb::blocked_range<uinteger>{0u, numPixels},
+                    [&](auto&& range) {
+                      // Only the first two channels contribute to the hash
+                      const auto end = range.end();
+                      for (auto i = range.begin(); i < end; ++i)
+                      {
+                        o_chromaIds[i] = hashChroma(
+                          fpreal3(r[i], g[i], 0.0_f), _maxChroma, _slots);
+                      }
+                    });
+}
+
 void estimateAlbedoIntensities(const Region _region,
                                fpreal* io_estimatedAlbedoIntensity,
+                               ChromaHistogram& io_histogram,
                                const fpreal* _intensity,
                                const fpreal* _albedoIntensity,
-                               const fpreal3* _chroma,
-                               const fpreal3 _maxChroma,
-                               const uinteger _numSlots,
+                               const ChromaId* _chromaIds,
+                               const uinteger* _paletteIndex,
                                const uinteger2 _imageDimensions,
                                const uinteger _regionScale) noexcept
 {
-  const uinteger numPixels       = _regionScale * _regionScale;
-  const uinteger numUniqueColors = _numSlots * _numSlots;
-  auto contributions =
-    static_cast<uinteger*>(alloca(numUniqueColors * sizeof(uinteger)));
-  std::fill_n(contributions, numUniqueColors, 0u);
+  const uinteger numPixels = _regionScale * _regionScale;
   // Average the shading intensity
   fpreal shadingIntensitySum(0.0_f);
   for_each_local_pixel(
     [&](auto pixel, auto) {
-      auto chromaId = hashChroma(_chroma[pixel], _maxChroma, _numSlots);
-      io_estimatedAlbedoIntensity[chromaId] += _intensity[pixel];
-      ++contributions[chromaId];
+      addSample(io_histogram,
+                _paletteIndex[_chromaIds[pixel]],
+                _intensity[pixel]);
       shadingIntensitySum += (_intensity[pixel] / _albedoIntensity[pixel]);
     },
     _region,
@@ -57,130 +188,562 @@ void estimateAlbedoIntensities(const Region _region,
     _regionScale);
   auto shadingIntensityAverage = shadingIntensitySum / numPixels;
 
-  for (uinteger i = 0u; i < numUniqueColors; ++i)
+  writeEstimates(
+    io_histogram, io_estimatedAlbedoIntensity, shadingIntensityAverage);
+  clearHistogram(io_histogram);
+}
+
+void estimateAlbedoIntensitiesSliding(const Region _firstRegion,
+                                      const uinteger _numRegions,
+                                      fpreal* io_estimatedAlbedoIntensity,
+                                      ChromaHistogram& io_histogram,
+                                      const fpreal* _intensity,
+                                      const fpreal* _albedoIntensity,
+                                      const ChromaId* _chromaIds,
+                                      const uinteger* _paletteIndex,
+                                      const uinteger _paletteSize,
+                                      const uinteger2 _imageDimensions,
+                                      const uinteger _regionScale) noexcept
+{
+  const uinteger numPixels = _regionScale * _regionScale;
+  // Running sums are kept in double precision, as values are repeatedly added
+  // and removed while the window slides
+  double shadingIntensitySum = 0.0;
+
+  const auto addColumn = [&](const uinteger _column) {
+    for (uinteger y = 0u; y < _regionScale; ++y)
+    {
+      auto pixel = (_firstRegion.y + y) * _imageDimensions.x + _column;
+      addSample(io_histogram,
+                _paletteIndex[_chromaIds[pixel]],
+                _intensity[pixel]);
+      shadingIntensitySum += _intensity[pixel] / _albedoIntensity[pixel];
+    }
+  };
+  const auto removeColumn = [&](const uinteger _column) {
+    for (uinteger y = 0u; y < _regionScale; ++y)
+    {
+      auto pixel = (_firstRegion.y + y) * _imageDimensions.x + _column;
+      removeSample(io_histogram,
+                   _paletteIndex[_chromaIds[pixel]],
+                   _intensity[pixel]);
+      shadingIntensitySum -= _intensity[pixel] / _albedoIntensity[pixel];
+    }
+  };
+
+  for (uinteger x = 0u; x < _regionScale; ++x)
+    addColumn(_firstRegion.x + x);
+
+  for (uinteger n = 0u; n < _numRegions; ++n)
   {
-    if (contributions[i])
-      io_estimatedAlbedoIntensity[i] /=
-        (contributions[i] * shadingIntensityAverage);
+    if (n)
+    {
+      removeColumn(_firstRegion.x + n - 1u);
+      addColumn(_firstRegion.x + n + _regionScale - 1u);
+    }
+    writeEstimates(io_histogram,
+                   io_estimatedAlbedoIntensity + n * _paletteSize,
+                   shadingIntensitySum / numPixels);
   }
+  clearHistogram(io_histogram);
 }
 
-namespace
+void SeparationContext::resize(const uinteger2 _imageDimensions,
+                               const uinteger _regionScale)
 {
-uinteger2 calculateContributions(uinteger2 _coord, uinteger2 _regionDim, uinteger2 _dim)
-{
-  auto coord = _coord + 1u;
-  return glm::min(_regionDim, coord, _dim - _coord);
-}
+  if (m_imageDim == _imageDimensions && m_regionScale == _regionScale)
+    return;
+  m_imageDim    = _imageDimensions;
+  m_regionScale = _regionScale;
+  // Divide our images into regions,
+  // we store the regions using pixel coordinates that represent their top left
+  // pixel. We know the width and height is the same for each
+  m_regions    = generateRegions(_imageDimensions, _regionScale);
+  m_filter     = gaussianFilter(uinteger2(_regionScale));
+  m_filterSums = filterSumPlane(m_filter, _regionScale, _imageDimensions);
+  const auto numRegionsXY = m_regions.m_numRegions;
+  std::cout << "Region generation complete: "
+            << numRegionsXY.x * numRegionsXY.y << " created.\n";
 }
 
-void seperateShading(const span<fpreal3> _sourceImage,
-                     fpreal3* io_albedo,
-                     fpreal* io_shadingIntensity,
-                     const uinteger2 _imageDimensions,
-                     const uinteger _regionScale,
-                     const uinteger _directIterations,
-                     const uinteger _intensityIterations,
-                     const uinteger _chromaSlots)
+uinteger SeparationContext::separate(const span<fpreal3> _sourceImage,
+                                     fpreal3* io_albedo,
+                                     fpreal* io_shadingIntensity,
+                                     const uinteger2 _imageDimensions,
+                                     const uinteger _regionScale,
+                                     const uinteger _directIterations,
+                                     const uinteger _intensityIterations,
+                                     const uinteger _chromaSlots,
+                                     const bool _slidingWindow,
+                                     const fpreal _tolerance,
+                                     const fpreal* _initialAlbedoIntensity,
+                                     const fpreal3* _maxChroma)
 {
   auto numPixels = _imageDimensions.x * _imageDimensions.y;
-  auto intensity = calculateIntensity(_sourceImage);
-  // Extract the chroma of the image using our intensity
-  auto chroma = calculateChroma(_sourceImage, intensity);
+  resize(_imageDimensions, _regionScale);
+  // Clamp the extreme highlights and shadows, and extract the intensity and
+  // chroma of the image in a single pass
+  prepareImage(_sourceImage, m_prepared);
+  auto& intensity = m_prepared.m_intensity;
+  auto& chroma    = m_prepared.m_chroma;
   // Our shading intensity defaults to one, so albedo intensity = source
   // intensity i = si * ai
-  auto albedoIntensity = intensity;
+  auto& albedoIntensity = m_albedoIntensity;
+  albedoIntensity.assign(intensity.begin(), intensity.end());
   std::fill_n(io_shadingIntensity, numPixels, 1.0_f);
-
-  // Divide our images into regions,
-  // we store the regions using pixel coordinates that represent their top left
-  // pixel. We know the width and height is the same for each
-  auto regionResult   = generateRegions(_imageDimensions, _regionScale);
-  auto&& regions      = regionResult.m_regions;
-  auto&& numRegionsXY = regionResult.m_numRegions;
-  auto numRegions     = numRegionsXY.x * numRegionsXY.y;
-  std::cout << "Region generation complete: " << numRegions << " created.\n";
-
-  // Find the largest chroma value
-  auto maxChroma = std::accumulate(chroma.begin(), chroma.end(), fpreal3(0.0_f),
-      [](const auto& a, const auto& b)
-      {
-        return glm::max(a, b);
+  // When given an initial albedo estimate, the shading must account for it
+  if (_initialAlbedoIntensity)
+  {
+    std::copy_n(_initialAlbedoIntensity, numPixels, albedoIntensity.begin());
+    tbb::parallel_for(
+      tbb::blocked_range<uinteger>{0u, numPixels}, [&](auto&& r) {
+        const auto end = r.end();
+        for (auto i = r.begin(); i < end; ++i)
+        {
+          io_shadingIntensity[i] = intensity[i] / albedoIntensity[i];
+        }
       });
+  }
+
+  auto&& regions      = m_regions.m_regions;
+  auto&& numRegionsXY = m_regions.m_numRegions;
 
+  // Quantise relative to the largest chroma value, unless one was provided
+  const fpreal3 maxChroma = _maxChroma ? *_maxChroma : m_prepared.m_maxChroma;
+
+  // Quantise the chroma once up front, rather than for every region
+  m_chromaIds.resize(numPixels);
+  calculateChromaIds(chroma, maxChroma, _chromaSlots, m_chromaIds.data());
+  const auto& chromaIds        = m_chromaIds;
   const uinteger totalNumSlots = _chromaSlots * _chromaSlots;
-  const auto filter = gaussianFilter(uinteger2(_regionScale));
+  const auto& filter           = m_filter;
+  const auto& filterSums       = m_filterSums;
+  auto& interimAlbedoIntensity = m_interimAlbedoIntensity;
+  auto& rowEstimates           = m_rowEstimates;
+  auto& palette                = m_palette;
+  auto& histograms             = m_histograms;
 
+  const auto maxReduce = [](fpreal a, fpreal b) { return std::max(a, b); };
+  uinteger numIterations = 0u;
   for (uinteger resetNum = 0u; resetNum < _directIterations; ++resetNum)
   {
-    // Reset the intensity to the albedo intensity every step
-    intensity = albedoIntensity;
+    // Reset the intensity to the albedo intensity every step after the first.
+    // The first step always works from the source intensity, an initial
+    // albedo estimate only seeds the albedo intensity and shading.
+    if (resetNum)
+      intensity = albedoIntensity;
     for (uinteger iter = 0u; iter < _intensityIterations; ++iter)
     {
-      std::cout << "\33[2K\rIteration " << 
-        iter + _intensityIterations * resetNum + 1 << ". " << std::flush;
+      std::cout << "\33[2K\rIteration " << numIterations + 1 << ". "
+                << std::flush;
 
-      std::vector<uinteger> pixelContributions(numPixels, 0u);
-      std::vector<fpreal> interimAlbedoIntensity(numPixels, 0.0_f);
-      // For each region
-      for (uinteger i = 0; i < numRegions; ++i)
+      interimAlbedoIntensity.assign(numPixels, 0.0_f);
+      // Start with a palette of the values in the first band of rows
+      resetPalette(palette, totalNumSlots);
+      for (uinteger y = 0u; y < _regionScale; ++y)
       {
-        auto region = regions[i];
-        std::vector<fpreal> estimatedAlbedoIntensity(totalNumSlots, 0.0_f);
-        estimateAlbedoIntensities(region,
-                                  estimatedAlbedoIntensity.data(),
-                                  intensity.data(),
-                                  albedoIntensity.data(),
-                                  chroma.data(),
-                                  maxChroma,
-                                  _chromaSlots,
-                                  _imageDimensions,
-                                  _regionScale);
-        for_each_local_pixel(
-          [&](auto pixel, auto local) {
-            auto chromaId = hashChroma(chroma[pixel], maxChroma, _chromaSlots);
-            auto w = filter[local];
-            interimAlbedoIntensity[pixel] += estimatedAlbedoIntensity[chromaId] * w;
-          },
-          region,
-          _imageDimensions,
-          _regionScale);
+        addPaletteRow(palette,
+                      chromaIds.data() + y * _imageDimensions.x,
+                      _imageDimensions.x);
       }
+      // Process one row of regions at a time, regions within a row only
+      // depend on the previous iteration so they can be estimated in parallel
+      for (uinteger regionRow = 0u; regionRow < numRegionsXY.y; ++regionRow)
+      {
+        // Estimating a whole row at once would take a value per palette slot
+        // for every region, so the row is estimated and gathered in chunks of
+        // regions whose estimates fit in k_maxRowEstimates
+        const uinteger paletteSize = palette.m_size;
+        const uinteger chunkSize   = std::min(
+          numRegionsXY.x, std::max(1u, k_maxRowEstimates / paletteSize));
+        if (rowEstimates.size() < chunkSize * paletteSize)
+          rowEstimates.resize(chunkSize * paletteSize);
+        for (uinteger chunkBegin = 0u; chunkBegin < numRegionsXY.x;
+             chunkBegin += chunkSize)
+        {
+          const uinteger chunkEnd =
+            std::min(chunkBegin + chunkSize, numRegionsXY.x);
+          if (_slidingWindow)
+          {
+            // Each task slides a window along its own span of the row, the
+            // grain size amortises the initial full window build
+            tbb::parallel_for(
+              tbb::blocked_range<uinteger>{
+                chunkBegin, chunkEnd, 4u * _regionScale},
+              [&](auto&& r) {
+                auto& histogram = histograms.local();
+                resizeHistogram(histogram, paletteSize);
+                estimateAlbedoIntensitiesSliding(
+                  regions[regionRow * numRegionsXY.x + r.begin()],
+                  r.size(),
+                  rowEstimates.data() + (r.begin() - chunkBegin) * paletteSize,
+                  histogram,
+                  intensity.data(),
+                  albedoIntensity.data(),
+                  chromaIds.data(),
+                  palette.m_index.data(),
+                  paletteSize,
+                  _imageDimensions,
+                  _regionScale);
+              });
+          }
+          else
+          {
+            // Neighbouring regions overlap in all but one column, so hand out
+            // blocks of a few R adjacent regions to keep the shared columns
+            // in cache, which still leaves many blocks per row to spread over
+            // the threads
+            tbb::parallel_for(
+              tbb::blocked_range<uinteger>{
+                chunkBegin, chunkEnd, 4u * _regionScale},
+              [&](auto&& r) {
+                auto& histogram = histograms.local();
+                resizeHistogram(histogram, paletteSize);
+                const auto end = r.end();
+                for (auto x = r.begin(); x < end; ++x)
+                {
+                  estimateAlbedoIntensities(
+                    regions[regionRow * numRegionsXY.x + x],
+                    rowEstimates.data() + (x - chunkBegin) * paletteSize,
+                    histogram,
+                    intensity.data(),
+                    albedoIntensity.data(),
+                    chromaIds.data(),
+                    palette.m_index.data(),
+                    _imageDimensions,
+                    _regionScale);
+                }
+              });
+          }
+          // Gather the weighted estimates of this chunk into each pixel it
+          // covers. Chunks and the regions within them are visited in
+          // ascending order, so the sum for each pixel is accumulated in the
+          // same order as a serial scatter.
+          const uinteger numColumns = chunkEnd + _regionScale - 1u - chunkBegin;
+          tbb::parallel_for(
+            tbb::blocked_range<uinteger>{0u, _regionScale * numColumns},
+            [&](auto&& r) {
+              const auto end = r.end();
+              for (auto i = r.begin(); i < end; ++i)
+              {
+                const uinteger ly = i / numColumns;
+                const uinteger px = chunkBegin + i % numColumns;
+                const uinteger pixel =
+                  (regionRow + ly) * _imageDimensions.x + px;
+                const uinteger first = std::max(
+                  chunkBegin, px < _regionScale ? 0u : px - _regionScale + 1u);
+                const uinteger last = std::min(px + 1u, chunkEnd);
+                auto slot           = palette.m_index[chromaIds[pixel]];
+                for (uinteger x = first; x < last; ++x)
+                {
+                  auto w = filter[ly * _regionScale + (px - x)];
+                  interimAlbedoIntensity[pixel] +=
+                    rowEstimates[(x - chunkBegin) * paletteSize + slot] * w;
+                }
+              }
+            });
+        }
 
-      tbb::parallel_for(tbb::blocked_range<uinteger>{0u, numPixels},
-                        [&](auto&& r) {
-                          const auto end = r.end();
-                          for (auto i = r.begin(); i < end; ++i)
-                          {
-                            uinteger2 pixelCoord{i%_imageDimensions.x, i/_imageDimensions.x};
-                            auto contrib = calculateContributions(pixelCoord, uinteger2(_regionScale), _imageDimensions);
-                            auto pixelContributions = filterSum(filter, uinteger2(_regionScale), contrib);
-                            albedoIntensity[i] =
-                              interimAlbedoIntensity[i] / (pixelContributions);
-                          }
-                        });
+        // Slide the palette down to cover the next row of regions
+        if (regionRow + 1u < numRegionsXY.y)
+        {
+          removePaletteRow(palette,
+                           chromaIds.data() + regionRow * _imageDimensions.x,
+                           _imageDimensions.x);
+          addPaletteRow(palette,
+                        chromaIds.data() +
+                          (regionRow + _regionScale) * _imageDimensions.x,
+                        _imageDimensions.x);
+        }
+      }
+
+      // Normalise the new estimates, and find the largest change
+      auto residual = tbb::parallel_reduce(
+        tbb::blocked_range<uinteger>{0u, numPixels},
+        0.0_f,
+        [&](auto&& r, fpreal maxDelta) {
+          const auto end = r.end();
+          for (auto i = r.begin(); i < end; ++i)
+          {
+            auto updated = interimAlbedoIntensity[i] / filterSums[i];
+            auto delta   = std::abs(updated - albedoIntensity[i]);
+            maxDelta     = std::max(maxDelta, delta);
+            albedoIntensity[i] = updated;
+          }
+          return maxDelta;
+        },
+        maxReduce);
+      ++numIterations;
+      if (residual <= _tolerance)
+        break;
     }
     // Calculate shading intensity
-    tbb::parallel_for(
-      tbb::blocked_range<uinteger>{0u, numPixels}, [&](auto&& r) {
+    auto residual = tbb::parallel_reduce(
+      tbb::blocked_range<uinteger>{0u, numPixels},
+      0.0_f,
+      [&](auto&& r, fpreal maxDelta) {
         const auto end = r.end();
         for (auto i = r.begin(); i < end; ++i)
         {
-          io_shadingIntensity[i] += (intensity[i] / albedoIntensity[i] - 1.0_f);
+          auto delta = intensity[i] / albedoIntensity[i] - 1.0_f;
+          maxDelta   = std::max(maxDelta, std::abs(delta));
+          io_shadingIntensity[i] += delta;
         }
-      });
+        return maxDelta;
+      },
+      maxReduce);
+    if (residual <= _tolerance)
+      break;
   }
-  std::cout<<"\33[2K\r" << _directIterations * _intensityIterations << 
-    " Iterations completed.\n"<<std::flush;
+  std::cout << "\33[2K\r" << numIterations << " Iterations completed.\n"
+            << std::flush;
 
   // Calculate final albedo
-  tbb::parallel_for(tbb::blocked_range<uinteger>{0u, numPixels}, [&](auto&& r) {
-    const auto end = r.end();
-    for (auto i = r.begin(); i < end; ++i)
+  scaleToInterleaved(chroma, albedoIntensity, io_albedo);
+  return numIterations;
+}
+
+uinteger seperateShading(const span<fpreal3> _sourceImage,
+                         fpreal3* io_albedo,
+                         fpreal* io_shadingIntensity,
+                         const uinteger2 _imageDimensions,
+                         const uinteger _regionScale,
+                         const uinteger _directIterations,
+                         const uinteger _intensityIterations,
+                         const uinteger _chromaSlots,
+                         const bool _slidingWindow,
+                         const fpreal _tolerance,
+                         const fpreal* _initialAlbedoIntensity,
+                         const fpreal3* _maxChroma)
+{
+  SeparationContext context;
+  return context.separate(_sourceImage,
+                          io_albedo,
+                          io_shadingIntensity,
+                          _imageDimensions,
+                          _regionScale,
+                          _directIterations,
+                          _intensityIterations,
+                          _chromaSlots,
+                          _slidingWindow,
+                          _tolerance,
+                          _initialAlbedoIntensity,
+                          _maxChroma);
+}
+
+uinteger seperateShadingPyramid(const span<fpreal3> _sourceImage,
+                                fpreal3* io_albedo,
+                                fpreal* io_shadingIntensity,
+                                const uinteger2 _imageDimensions,
+                                const uinteger _regionScale,
+                                const uinteger _directIterations,
+                                const uinteger _intensityIterations,
+                                const uinteger _chromaSlots,
+                                const bool _slidingWindow,
+                                const fpreal _tolerance,
+                                const uinteger _levels,
+                                const uinteger _refineIterations)
+{
+  // Build the pyramid, stopping early if a level would be smaller than its
+  // regions
+  std::vector<std::vector<fpreal3>> levelImages;
+  std::vector<uinteger2> levelDims{_imageDimensions};
+  std::vector<uinteger> levelScales{_regionScale};
+  while (levelDims.size() < _levels)
+  {
+    const auto dim   = (levelDims.back() + 1u) / 2u;
+    const auto scale = std::max(2u, levelScales.back() / 2u);
+    if (dim.x < scale || dim.y < scale)
+      break;
+    const auto source = levelImages.empty()
+                          ? _sourceImage
+                          : makeSpan(levelImages.back().data(),
+                                     levelDims.back().x * levelDims.back().y);
+    levelImages.push_back(downsample(source, levelDims.back()));
+    levelDims.push_back(dim);
+    levelScales.push_back(scale);
+  }
+
+  std::vector<fpreal> albedoIntensity;
+  SeparationContext context;
+  uinteger numIterations = 0u;
+  for (uinteger level = levelDims.size(); level-- > 0u;)
+  {
+    const auto dim           = levelDims[level];
+    const uinteger numPixels = dim.x * dim.y;
+    std::cout << "Separating level " << level << " (" << dim.x << 'x' << dim.y
+              << ")\n";
+    // The finest level writes straight into the output
+    std::vector<fpreal3> levelAlbedo(level ? numPixels : 0u);
+    std::vector<fpreal> levelShading(level ? numPixels : 0u);
+    auto albedo  = level ? levelAlbedo.data() : io_albedo;
+    auto shading = level ? levelShading.data() : io_shadingIntensity;
+    auto source  = level ? makeSpan(levelImages[level - 1u].data(), numPixels)
+                        : _sourceImage;
+
+    // Only the coarsest level runs the full set of iterations
+    const bool coarsest = level + 1u == levelDims.size();
+    std::vector<fpreal> initialAlbedoIntensity;
+    if (!coarsest)
     {
-      io_albedo[i] = albedoIntensity[i] * chroma[i];
+      initialAlbedoIntensity = resampleBilinear(
+        albedoIntensity, levelDims[level + 1u], dim);
     }
-  });
+    numIterations += context.separate(
+      source,
+      albedo,
+      shading,
+      dim,
+      levelScales[level],
+      coarsest ? _directIterations : 1u,
+      coarsest ? _intensityIterations : _refineIterations,
+      _chromaSlots,
+      _slidingWindow,
+      _tolerance,
+      coarsest ? nullptr : initialAlbedoIntensity.data());
+
+    // Chroma sums to three, so the albedo intensity is the mean of the albedo
+    if (level)
+      albedoIntensity = calculateIntensity(makeSpan(albedo, numPixels));
+  }
+  return numIterations;
+}
+
+void seperateShadingTiled(const string_view _sourceFile,
+                          const string_view _albedoFile,
+                          const string_view _shadingFile,
+                          const uinteger _tileSize,
+                          const uinteger _regionScale,
+                          const uinteger _directIterations,
+                          const uinteger _intensityIterations,
+                          const uinteger _chromaSlots,
+                          const bool _slidingWindow,
+                          const fpreal _tolerance)
+{
+  const uinteger tileSize = std::max(_tileSize, _regionScale);
+  const uinteger halo     = _regionScale - 1u;
+
+  // The chroma quantisation must be consistent across tiles, so first stream
+  // the whole image to find the largest chroma value
+  fpreal3 maxChroma(0.0_f);
+  uinteger2 imageDim;
+  {
+    ImageReader input(_sourceFile);
+    imageDim = input.dimensions();
+    input.forEachBand<fpreal3>(
+      tileSize, [&](uinteger, uinteger, span<fpreal3> _rows) {
+        maxChroma = glm::max(maxChroma, prepareImage(_rows).m_maxChroma);
+      });
+  }
+
+  ImageReader input(_sourceFile);
+  ImageWriter albedo(_albedoFile, imageDim, 3u);
+  ImageWriter shading(_shadingFile, imageDim, 1u);
+
+  // Rolling window of source rows, covering the current band and its halo
+  std::vector<fpreal3> sourceRows;
+  uinteger rowsBegin = 0u;
+  uinteger rowsEnd   = 0u;
+  // The rows the next band adds to the window, read while this one separates
+  std::vector<fpreal3> nextRows;
+  uinteger nextEnd = 0u;
+  std::vector<fpreal3> bandAlbedo(imageDim.x * tileSize);
+  std::vector<fpreal> bandShading(imageDim.x * tileSize);
+  std::vector<fpreal3> tileSource;
+  std::vector<fpreal3> tileAlbedo;
+  std::vector<fpreal> tileShading;
+  // Interior tiles all share a size, so keep a separate context for the edge
+  // tiles to avoid rebuilding the layout of each at every switch
+  SeparationContext interiorContext;
+  SeparationContext edgeContext;
+
+  for (uinteger bandBegin = 0u; bandBegin < imageDim.y; bandBegin += tileSize)
+  {
+    const uinteger bandEnd   = std::min(bandBegin + tileSize, imageDim.y);
+    const uinteger haloBegin = bandBegin > halo ? bandBegin - halo : 0u;
+    const uinteger haloEnd   = std::min(bandEnd + halo, imageDim.y);
+    std::cout << "Separating rows " << bandBegin << " to " << bandEnd << '\n';
+
+    // Drop the rows we no longer need, and append the new ones in order
+    sourceRows.erase(sourceRows.begin(),
+                     sourceRows.begin() + (haloBegin - rowsBegin) * imageDim.x);
+    rowsBegin = haloBegin;
+    if (!bandBegin)
+    {
+      nextRows.resize((haloEnd - rowsEnd) * imageDim.x);
+      input.readRows(rowsEnd, haloEnd, nextRows.data());
+      nextEnd = haloEnd;
+    }
+    sourceRows.insert(sourceRows.end(), nextRows.begin(), nextRows.end());
+    rowsEnd = nextEnd;
+
+    // Start reading the rows of the next band's halo
+    nextEnd = std::min(bandEnd + tileSize + halo, imageDim.y);
+    nextRows.resize((nextEnd - rowsEnd) * imageDim.x);
+    tbb::task_group prefetch;
+    if (nextEnd > rowsEnd)
+    {
+      prefetch.run(
+        [&] { input.readRows(rowsEnd, nextEnd, nextRows.data()); });
+    }
+
+    for (uinteger tileBegin = 0u; tileBegin < imageDim.x; tileBegin += tileSize)
+    {
+      const uinteger tileEnd = std::min(tileBegin + tileSize, imageDim.x);
+      const uinteger2 begin{tileBegin > halo ? tileBegin - halo : 0u,
+                            haloBegin};
+      const uinteger2 end{std::min(tileEnd + halo, imageDim.x), haloEnd};
+      const uinteger2 tileDim  = end - begin;
+      const uinteger numPixels = tileDim.x * tileDim.y;
+
+      tileSource.resize(numPixels);
+      tileAlbedo.resize(numPixels);
+      tileShading.resize(numPixels);
+      for (uinteger y = 0u; y < tileDim.y; ++y)
+      {
+        const uinteger sourceRow =
+          (y + begin.y - rowsBegin) * imageDim.x + begin.x;
+        std::copy_n(sourceRows.begin() + sourceRow,
+                    tileDim.x,
+                    tileSource.begin() + y * tileDim.x);
+      }
+
+      const bool interior = tileDim == uinteger2(tileSize + 2u * halo);
+      auto& context       = interior ? interiorContext : edgeContext;
+      context.separate(makeSpan(tileSource.data(), numPixels),
+                       tileAlbedo.data(),
+                       tileShading.data(),
+                       tileDim,
+                       _regionScale,
+                       _directIterations,
+                       _intensityIterations,
+                       _chromaSlots,
+                       _slidingWindow,
+                       _tolerance,
+                       nullptr,
+                       &maxChroma);
+
+      // Keep only the interior of the tile
+      for (uinteger y = bandBegin; y < bandEnd; ++y)
+      {
+        const uinteger tileRow =
+          (y - begin.y) * tileDim.x + tileBegin - begin.x;
+        const uinteger bandRow = (y - bandBegin) * imageDim.x + tileBegin;
+        std::copy_n(tileAlbedo.begin() + tileRow,
+                    tileEnd - tileBegin,
+                    bandAlbedo.begin() + bandRow);
+        std::copy_n(tileShading.begin() + tileRow,
+                    tileEnd - tileBegin,
+                    bandShading.begin() + bandRow);
+      }
+    }
+
+    albedo.writeRows(bandBegin, bandEnd, bandAlbedo.data());
+    shading.writeRows(bandBegin, bandEnd, bandShading.data());
+    prefetch.wait();
+  }
+  albedo.close();
+  shading.close();
 }
 
 END_AUTOTEXGEN_NAMESPACE
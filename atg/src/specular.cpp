@@ -1,6 +1,7 @@
 #include "specular.h"
 
 #include "cluster.h"
+#include "color_index.h"
 #include "morph.h"
 #include "util.h"
 
@@ -8,8 +9,14 @@
 #include <glm/gtx/norm.hpp>
 
 #include <algorithm>
+#include <cassert>
 #include <iostream>
+#include <numeric>
 #include <unordered_set>
+#include <tbb/blocked_range.h>
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_sort.h>
 
 BEGIN_AUTOTEXGEN_NAMESPACE
 
@@ -23,180 +30,208 @@ auto erase_where(Container& c, F&& f)
 }
 }  // namespace
 
-std::vector<std::vector<uinteger>> initMaterialSets(const span<fpreal3> _albedo,
-                                                    uinteger2 _imageDim,
-                                                    uinteger _numSets)
-{
-  const uinteger numPixels = _albedo.size();
-  // Use k-means clustering to group the pixels into distinct segements
-  auto clusters  = kmeans_lloyd(_albedo, _numSets);
-  const auto& px = std::get<1>(clusters);
+constexpr uint8_t MaterialSets::EXCLUDED;
 
-  // reverse the mapping, so we have mean -> [pixels]
-  std::vector<std::vector<atg::uinteger>> inv(_numSets);
-  for (uinteger i = 0; i < numPixels; ++i)
+void buildSetIndices(MaterialSets& io_sets)
+{
+  auto& offsets = io_sets.m_offsets;
+  offsets.assign(io_sets.m_numSets + 1u, 0u);
+  for (const auto& label : io_sets.m_labels)
   {
-    inv[px[i]].push_back(i);
+    if (label != MaterialSets::EXCLUDED)
+      ++offsets[label + 1u];
   }
+  std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
 
-  std::vector<std::vector<uinteger>> materialSets;
-  materialSets.resize(_numSets);
-
-  auto mask   = std::make_unique<atg::fpreal[]>(numPixels);
-  auto eroded = std::make_unique<atg::fpreal[]>(numPixels);
-  for (uinteger i = 0u; i < _numSets; ++i)
+  // Fill each set in pixel order, advancing a cursor per set
+  io_sets.m_indices.resize(offsets.back());
+  std::vector<uinteger> cursors(offsets.begin(), offsets.end() - 1);
+  const uinteger numPixels = io_sets.m_labels.size();
+  for (uinteger i = 0u; i < numPixels; ++i)
   {
-    std::fill_n(mask.get(), numPixels, 0.0_f);
-    for (auto px : inv[i])
-      mask[px] = 1.0_f;
-    std::fill_n(eroded.get(), numPixels, 0.0_f);
-    erode(mask.get(),
-          eroded.get(),
-          _imageDim,
-          {3, 3},
-          35 * (inv[i].size() / float(numPixels)));
-
-    auto& matSet = materialSets[i];
-    for (uinteger px = 0u; px < numPixels; ++px)
-    {
-      if (eroded[px] > 0.0_f)
-        matSet.push_back(px);
-    }
+    const auto label = io_sets.m_labels[i];
+    if (label != MaterialSets::EXCLUDED)
+      io_sets.m_indices[cursors[label]++] = i;
   }
-
-  return materialSets;
 }
 
-namespace
+MaterialSets initMaterialSets(const span<fpreal3> _albedo,
+                              uinteger2 _imageDim,
+                              uinteger _numSets,
+                              KMeansAlgorithm _algorithm,
+                              uinteger _sampleSize)
 {
-std::vector<std::pair<uinteger, uinteger>>
-closestColIndices(const span<std::vector<uinteger>> _indexSets,
-                  const span<fpreal3> _cols,
-                  uinteger _idx,
-                  uinteger _numCols)
-{
-  // our albedo color
-  const auto& col = _cols[_idx];
-  // a vector of pairs, first: the set index, second: the index of the pixel
-  std::vector<std::pair<uinteger, uinteger>> closest(_indexSets.size());
-  const auto comp = [&](const auto& lhs, const auto& rhs) {
-    return glm::distance2(col, _cols[lhs.second]) <
-           glm::distance2(col, _cols[rhs.second]);
-  };
+  assert(_numSets <= MaterialSets::EXCLUDED);
+  const uinteger numPixels = _albedo.size();
+  // Use k-means clustering to group the pixels into distinct segements
+  auto clusters  = kmeans_sampled(_albedo, _numSets, _sampleSize, _algorithm);
+  const auto& px = std::get<1>(clusters);
 
-  for (uinteger k = 0u; k < _indexSets.size(); ++k)
+  MaterialSets materialSets;
+  materialSets.m_numSets = _numSets;
+  materialSets.m_labels.assign(px.begin(), px.end());
+
+  // Erode each set in proportion to its share of the image, as though a 3x3
+  // structuring element were applied that many times
+  std::vector<uinteger> setSizes(_numSets);
+  for (const auto& label : px)
+    ++setSizes[label];
+  const uinteger2 structuringElement{3u, 3u};
+  std::vector<uinteger2> kernelHalves(_numSets);
+  for (uinteger i = 0u; i < _numSets; ++i)
   {
-    const auto& indices = _indexSets[k];
-    for (const auto& i : indices)
-    {
-      std::pair<uinteger, uinteger> cur{k, i};
-      if (closest.size() && comp(cur, closest[0]))
-      {
-        std::pop_heap(closest.begin(), closest.end(), comp);
-        closest.pop_back();
-      }
-      if (closest.size() < _numCols)
-      {
-        closest.push_back(cur);
-        std::push_heap(closest.begin(), closest.end(), comp);
-      }
-    }
+    const uinteger iter = 35 * (setSizes[i] / float(numPixels));
+    kernelHalves[i]     = ((structuringElement - uinteger2(1u)) * iter) / 2u;
   }
 
-  return closest;
+  auto& labels = materialSets.m_labels;
+  erodeLabels(
+    labels, _imageDim, kernelHalves, MaterialSets::EXCLUDED, labels.data());
+  buildSetIndices(materialSets);
+
+  return materialSets;
 }
 
-std::vector<uinteger> closestColIndicess(const span<const uinteger> _indexSet,
-                                         const span<fpreal3> _cols,
-                                         uinteger _idx,
-                                         uinteger _numCols)
+namespace
 {
-  // our albedo color
-  const auto& col = _cols[_idx];
-  // a vector of pairs, first: the set index, second: the index of the pixel
-  std::vector<uinteger> closest(_numCols);
-  const auto comp = [&](const auto& lhs, const auto& rhs) {
-    return glm::distance2(col, _cols[lhs]) < glm::distance2(col, _cols[rhs]);
+// Finds the distinct colours of _image, writing the position of each pixel's
+// colour in the returned table to o_colorIds
+std::vector<fpreal3> uniqueColors(const span<fpreal3> _image,
+                                  uinteger* o_colorIds)
+{
+  const uinteger numPixels = _image.size();
+  const auto lexicographic = [&](const uinteger lhs, const uinteger rhs) {
+    const auto& a = _image[lhs];
+    const auto& b = _image[rhs];
+    if (a.x != b.x)
+      return a.x < b.x;
+    if (a.y != b.y)
+      return a.y < b.y;
+    return a.z < b.z;
   };
+  std::vector<uinteger> order(numPixels);
+  std::iota(order.begin(), order.end(), 0u);
+  tbb::parallel_sort(order.begin(), order.end(), lexicographic);
 
-  for (const auto& i : _indexSet)
+  // Equal colours are now adjacent, so start a new entry at every change
+  std::vector<fpreal3> colors;
+  for (uinteger i = 0u; i < numPixels; ++i)
   {
-    if (closest.size() && comp(i, closest[0]))
-    {
-      std::pop_heap(closest.begin(), closest.end(), comp);
-      closest.pop_back();
-    }
-    if (closest.size() < _numCols)
-    {
-      closest.push_back(i);
-      std::push_heap(closest.begin(), closest.end(), comp);
-    }
+    if (!i || _image[order[i]] != colors.back())
+      colors.push_back(_image[order[i]]);
+    o_colorIds[order[i]] = colors.size() - 1u;
   }
-
-  return closest;
+  return colors;
 }
 
 }  // namespace
 
-void removeOutliers(span<std::vector<uinteger>> _materialTypes,
-                    const span<fpreal3> _albedo)
+void removeOutliers(MaterialSets& io_sets, const span<fpreal3> _albedo)
 {
   const uinteger k = 10u;
-  uinteger tNum    = 0u;
-  std::vector<std::vector<uinteger>> materialSets(_materialTypes.size());
-  for (const auto& type : _materialTypes)
-  {
-    for (const auto& px : type)
-    {
-      auto closest = closestColIndices(_materialTypes, _albedo, px, k);
-      auto count =
-        std::count_if(closest.begin(), closest.end(), [&](const auto& e) {
-          return tNum == e.first;
-        });
-      if (count >= k / 2)
-        materialSets[tNum].push_back(px);
-    }
-    ++tNum;
-  }
+  // Index the pixels of every set together, so each query finds the closest
+  // colours regardless of which set they belong to
+  const auto index =
+    buildColorIndex(io_sets.m_offsets, io_sets.m_indices, _albedo);
+  tbb::enumerable_thread_specific<std::vector<ColorNeighbour>> neighbours;
+
+  // Exclude the pixels that are not mostly surrounded by colours of their own
+  // set. Only the labels change, so every set can be processed at once.
+  tbb::parallel_for(
+    tbb::blocked_range<uinteger>{0u, uinteger(io_sets.m_indices.size())},
+    [&](const auto& r) {
+      auto& closest  = neighbours.local();
+      const auto end = r.end();
+      for (auto i = r.begin(); i < end; ++i)
+      {
+        const auto px    = io_sets.m_indices[i];
+        const auto label = io_sets.m_labels[px];
+        nearestColors(index, _albedo[px], k, closest);
+        auto count =
+          std::count_if(closest.begin(), closest.end(), [&](const auto& e) {
+            return label == e.m_label;
+          });
+        if (count < k / 2)
+          io_sets.m_labels[px] = MaterialSets::EXCLUDED;
+      }
+    });
 
-  std::copy(materialSets.begin(), materialSets.end(), _materialTypes.begin());
+  buildSetIndices(io_sets);
 }
 
 std::vector<std::vector<fpreal>>
-computeProbability(const span<std::vector<uinteger>> _materialSets,
-                   const span<fpreal3> _albedo)
+computeProbability(const MaterialSets& _sets, const span<fpreal3> _albedo)
 {
   const uinteger numPixels = _albedo.size();
+  const uinteger numSets   = _sets.m_numSets;
   const uinteger k         = 10u;
-  const fpreal ik          = 1.0_f / k;
-  std::vector<std::vector<fpreal>> probabilities(_materialSets.size());
-  for (auto& prob : probabilities)
-    prob.resize(numPixels);
-
-  for (uinteger i = 0u; i < numPixels; ++i)
-  {
-    // compute set distances
-    std::vector<fpreal> distances;
-    distances.reserve(_materialSets.size());
-    for (const auto& ms : _materialSets)
-    {
-      auto closest  = closestColIndicess(ms, _albedo, i, k);
-      auto distance = 0.0_f;
-      for (const auto& c : closest)
-      {
-        distance += glm::fastDistance(_albedo[c], _albedo[i]);
-      }
-      distances.push_back(1.0_f / (ik * distance));
-    }
 
-    auto distanceSum = std::accumulate(distances.begin(), distances.end(), 0.0_f);
+  // The probabilities only depend on a pixel's colour, and albedo maps tend
+  // to reuse few colours, so compute them once per distinct colour
+  std::vector<uinteger> colorIds(numPixels);
+  const auto colors        = uniqueColors(_albedo, colorIds.data());
+  const uinteger numColors = colors.size();
 
-    for (uinteger j = 0u; j < _materialSets.size(); ++j)
-    {
-      probabilities[j][i] = (distances[j] / distanceSum);
-    }
+  std::vector<ColorIndex> indices;
+  indices.reserve(numSets);
+  for (uinteger j = 0u; j < numSets; ++j)
+  {
+    indices.push_back(buildColorIndex(
+      makeSpan(&_sets.m_offsets[j], 2u), _sets.m_indices, _albedo));
   }
 
+  // Probability table, one row of colours per set
+  std::vector<fpreal> table(numSets * numColors);
+  tbb::enumerable_thread_specific<std::vector<ColorNeighbour>> neighbours;
+  tbb::parallel_for(tbb::blocked_range<uinteger>{0u, numColors},
+                    [&](const auto& r) {
+                      auto& closest = neighbours.local();
+                      std::vector<fpreal> distances(numSets);
+                      const auto end = r.end();
+                      for (auto i = r.begin(); i < end; ++i)
+                      {
+                        // compute set distances, an empty set is never
+                        // closest so it keeps a zero weight
+                        for (uinteger j = 0u; j < numSets; ++j)
+                        {
+                          nearestColors(indices[j], colors[i], k, closest);
+                          distances[j] = 0.0_f;
+                          if (closest.empty())
+                            continue;
+                          auto distance = 0.0_f;
+                          for (const auto& c : closest)
+                            distance += glm::fastSqrt(c.m_distance2);
+                          // Average over the neighbours found, a set may
+                          // hold fewer than k pixels
+                          distances[j] = closest.size() / distance;
+                        }
+
+                        auto distanceSum = std::accumulate(
+                          distances.begin(), distances.end(), 0.0_f);
+                        if (distanceSum == 0.0_f)
+                          continue;
+
+                        for (uinteger j = 0u; j < numSets; ++j)
+                          table[j * numColors + i] =
+                            distances[j] / distanceSum;
+                      }
+                    });
+
+  // Scatter the table back out to the pixels
+  std::vector<std::vector<fpreal>> probabilities(numSets);
+  for (auto& prob : probabilities)
+    prob.resize(numPixels);
+  tbb::parallel_for(tbb::blocked_range<uinteger>{0u, numPixels},
+                    [&](const auto& r) {
+                      const auto end = r.end();
+                      for (auto i = r.begin(); i < end; ++i)
+                      {
+                        for (uinteger j = 0u; j < numSets; ++j)
+                          probabilities[j][i] =
+                            table[j * numColors + colorIds[i]];
+                      }
+                    });
+
   return probabilities;
 }
 
@@ -1,6 +1,11 @@
 TEMPLATE = subdirs
-SUBDIRS = atg separation height_field probability
+SUBDIRS = atg separation height_field probability pipeline \
+          region_bench morph_check color_index_check
 
-separation.depend   = atg
-height_field.depend = atg
-probability.depend  = atg
+separation.depend        = atg
+height_field.depend      = atg
+probability.depend       = atg
+pipeline.depend          = atg
+region_bench.depend      = atg
+morph_check.depend       = atg
+color_index_check.depend = atg
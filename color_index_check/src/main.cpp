@@ -0,0 +1,162 @@
+#include "color_index.h"
+#include "types.h"
+
+#include <glm/gtx/norm.hpp>
+
+#include <algorithm>
+#include <cxxopts.hpp>
+#include <iostream>
+#include <random>
+#include <vector>
+
+namespace
+{
+inline static auto getParser()
+{
+  cxxopts::Options parser("Colour Index Check",
+                          "Compares the colour index against a brute force "
+                          "nearest neighbour search");
+  // clang-format off
+  parser.allow_unrecognised_options().add_options()
+    ("h,help", "Print help")
+    ("c,cases", "Number of random indices to check", cxxopts::value<atg::uinteger>()->default_value("1000"))
+    ("q,queries", "Queries per index", cxxopts::value<atg::uinteger>()->default_value("32"))
+    ("seed", "Random seed", cxxopts::value<atg::uinteger>()->default_value("0"))
+    ;
+  // clang-format on
+  return parser;
+}
+
+constexpr atg::uinteger k_maxSets   = 6u;
+constexpr atg::uinteger k_maxPixels = 400u;
+constexpr atg::uinteger k_maxK      = 24u;
+
+// Every indexed pixel's distance to _color, sorted nearest first
+std::vector<atg::fpreal>
+referenceDistances(const std::vector<atg::uinteger>& _offsets,
+                   const std::vector<atg::uinteger>& _indices,
+                   const std::vector<atg::fpreal3>& _colors,
+                   const atg::fpreal3 _color)
+{
+  using namespace atg;
+  std::vector<fpreal> distances;
+  for (auto i = _offsets.front(); i < _offsets.back(); ++i)
+    distances.push_back(glm::distance2(_color, _colors[_indices[i]]));
+  std::sort(distances.begin(), distances.end());
+  return distances;
+}
+
+// Ties may be broken either way, so compare the distances found and check
+// every match names a distinct pixel of the set it claims
+bool neighboursMatch(const std::vector<atg::uinteger>& _offsets,
+                     const std::vector<atg::uinteger>& _indices,
+                     const std::vector<atg::fpreal3>& _colors,
+                     const atg::fpreal3 _color,
+                     const atg::uinteger _k,
+                     const std::vector<atg::ColorNeighbour>& _neighbours)
+{
+  using namespace atg;
+  auto expected = referenceDistances(_offsets, _indices, _colors, _color);
+  expected.resize(std::min<uinteger>(_k, expected.size()));
+  if (_neighbours.size() != expected.size())
+    return false;
+
+  std::vector<uinteger> seen;
+  for (uinteger i = 0u; i < expected.size(); ++i)
+  {
+    const auto& n = _neighbours[i];
+    if (n.m_distance2 != expected[i] || n.m_label + 1u >= _offsets.size())
+      return false;
+    const auto first = _indices.begin() + _offsets[n.m_label];
+    const auto last  = _indices.begin() + _offsets[n.m_label + 1u];
+    if (std::find(first, last, n.m_index) == last ||
+        glm::distance2(_color, _colors[n.m_index]) != n.m_distance2)
+      return false;
+    seen.push_back(n.m_index);
+  }
+  std::sort(seen.begin(), seen.end());
+  return std::adjacent_find(seen.begin(), seen.end()) == seen.end();
+}
+
+}  // namespace
+
+int main(int argc, char* argv[])
+{
+  using namespace atg;
+  // Parse the commandline options
+  auto parser     = getParser();
+  const auto args = parser.parse(argc, argv);
+  if (args.count("help"))
+  {
+    std::cout << parser.help() << '\n';
+    std::exit(0);
+  }
+
+  const uinteger numCases   = args["cases"].as<uinteger>();
+  const uinteger numQueries = args["queries"].as<uinteger>();
+  std::mt19937 prng(args["seed"].as<uinteger>());
+  std::uniform_int_distribution<uinteger> pixelDist(1u, k_maxPixels);
+  std::uniform_int_distribution<uinteger> setDist(1u, k_maxSets);
+  std::uniform_int_distribution<uinteger> kDist(0u, k_maxK);
+  std::uniform_int_distribution<uinteger> levelDist(1u, 16u);
+  std::uniform_real_distribution<fpreal> unitDist(0.0_f, 1.0_f);
+
+  uinteger numMismatches = 0u;
+  std::vector<ColorNeighbour> neighbours;
+  for (uinteger c = 0u; c < numCases; ++c)
+  {
+    // Quantised colours, so equal distances are common
+    const uinteger numPixels = pixelDist(prng);
+    const auto levels        = fpreal(levelDist(prng));
+    const auto randomColor   = [&] {
+      return glm::floor(
+               fpreal3(unitDist(prng), unitDist(prng), unitDist(prng)) *
+               levels) /
+             levels;
+    };
+    std::vector<fpreal3> colors(numPixels);
+    for (auto& color : colors)
+      color = randomColor();
+
+    // Assign the pixels to sets at random, leaving some out and some sets
+    // empty
+    const uinteger numSets = setDist(prng);
+    std::uniform_int_distribution<uinteger> labelDist(0u, numSets);
+    std::vector<std::vector<uinteger>> sets(numSets);
+    for (uinteger i = 0u; i < numPixels; ++i)
+    {
+      const auto label = labelDist(prng);
+      if (label < numSets && label % 3u != 2u)
+        sets[label].push_back(i);
+    }
+    std::vector<uinteger> offsets{0u};
+    std::vector<uinteger> indices;
+    for (const auto& set : sets)
+    {
+      indices.insert(indices.end(), set.begin(), set.end());
+      offsets.push_back(indices.size());
+    }
+
+    const auto index = buildColorIndex(offsets, indices, colors);
+    for (uinteger q = 0u; q < numQueries; ++q)
+    {
+      // Query both indexed colours and arbitrary ones
+      const auto color =
+        q % 2u ? colors[q % numPixels]
+               : fpreal3(unitDist(prng), unitDist(prng), unitDist(prng));
+      const auto k = kDist(prng);
+      nearestColors(index, color, k, neighbours);
+      if (!neighboursMatch(offsets, indices, colors, color, k, neighbours))
+      {
+        std::cout << "Mismatch in case " << c << ", query " << q << " with "
+                  << indices.size() << " pixels in " << numSets
+                  << " sets, k = " << k << '\n';
+        ++numMismatches;
+        break;
+      }
+    }
+  }
+
+  std::cout << numCases << " cases, " << numMismatches << " mismatches\n";
+  return numMismatches ? 1 : 0;
+}
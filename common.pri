@@ -25,6 +25,8 @@ LIBS += -L/public/devel/2018/tbb/lib/intel64/gcc4.7
 LIBS +=  -ltbb -lOpenImageIO
 
 #DEFINES += _GLIBCXX_PARALLEL
+# Build the scalar image kernels rather than the AVX2 ones
+#DEFINES += AUTOTEXGEN_SCALAR_KERNELS
 DEFINES += GLM_ENABLE_EXPERIMENTAL GLM_FORCE_CTOR_INIT GLM_FORCE_RADIANS
 
 AUTOTEXGEN_NAMESPACE =atg
@@ -23,11 +23,33 @@ inline static auto getParser()
     ("o,output", "Output file name",    cxxopts::value<std::string>()->default_value("height_map.png")) 
     ("a,azimuth", "Azimuthal angle of lighting direction", cxxopts::value<atg::fpreal>()->default_value("45")) 
     ("p,polar", "Polar angle of lighting direction", cxxopts::value<atg::fpreal>()->default_value("45")) 
+    ("n,normal-iterations", "Maximum relative normal iterations", cxxopts::value<atg::uinteger>()->default_value("25"))
+    ("t,tolerance", "Stop iterating once no normal moves further than this", cxxopts::value<atg::fpreal>()->default_value("0"))
+    ("initial-normals", "Image of normals, as written by normals-output, to start the normal solve from, e.g. from a previous lighting direction", cxxopts::value<std::string>())
+    ("normals-output", "Write the relative normals to this image file, encoded as 0.5 + 0.5n", cxxopts::value<std::string>())
+    ("height-solver", "Absolute height solver, jacobi or multigrid", cxxopts::value<std::string>()->default_value("jacobi"))
+    ("height-tolerance", "Relative residual at which the multigrid height solver stops", cxxopts::value<atg::fpreal>()->default_value("1e-4"))
     ;
   // clang-format on
   return parser;
 }
 
+// Normals are stored as 0.5 + 0.5n, so that formats without negative values,
+// such as png, keep every component
+void encodeNormals(atg::span<atg::fpreal3> io_normals)
+{
+  using namespace atg;
+  for (auto& normal : io_normals)
+    normal = normal * 0.5_f + fpreal3(0.5_f);
+}
+
+void decodeNormals(atg::span<atg::fpreal3> io_normals)
+{
+  using namespace atg;
+  for (auto& normal : io_normals)
+    normal = normal * 2.0_f - fpreal3(1.0_f);
+}
+
 }  // namespace
 
 int main(int argc, char* argv[])
@@ -63,9 +85,46 @@ int main(int argc, char* argv[])
 
   clampExtremeties(shadingImage);
 
-  auto normals = computeRelativeNormals(shadingImage, L);
+  // Optionally warm start the normals from a previous run
+  std::unique_ptr<fpreal3[]> initialNormals;
+  if (args.count("initial-normals"))
+  {
+    auto normalsResult =
+      readImage<fpreal3>(args["initial-normals"].as<std::string>());
+    if (normalsResult.m_imageDim != imageDimensions)
+    {
+      std::cout << "Initial normals must match the shading map dimensions\n";
+      std::exit(1);
+    }
+    initialNormals = std::move(normalsResult.m_data);
+    decodeNormals(makeSpan(initialNormals, numPixels));
+  }
+
+  auto normals = computeRelativeNormals(shadingImage,
+                                        L,
+                                        args["normal-iterations"].as<uinteger>(),
+                                        args["tolerance"].as<fpreal>(),
+                                        initialNormals.get());
   auto rh = computeRelativeHeights(normals.data(), imageDimensions);
-  auto h = computeAbsoluteHeights(rh.data(), imageDimensions);
+  if (args.count("normals-output"))
+  {
+    encodeNormals(normals);
+    writeImage(args["normals-output"].as<std::string>(),
+               normals.data(),
+               imageDimensions);
+  }
+  const auto solverName = args["height-solver"].as<std::string>();
+  if (solverName != "jacobi" && solverName != "multigrid")
+  {
+    std::cout << "Unknown height solver: " << solverName << '\n';
+    std::exit(1);
+  }
+  const auto solver = solverName == "multigrid" ? HeightSolver::MULTIGRID
+                                                : HeightSolver::JACOBI;
+  auto h = computeAbsoluteHeights(rh.data(),
+                                  imageDimensions,
+                                  solver,
+                                  args["height-tolerance"].as<fpreal>());
   writeImage(args["output"].as<std::string>(),
              h.data(),
              imageDimensions);
@@ -0,0 +1,195 @@
+#include "morph.h"
+#include "types.h"
+
+#include <algorithm>
+#include <cxxopts.hpp>
+#include <iostream>
+#include <random>
+#include <vector>
+
+namespace
+{
+inline static auto getParser()
+{
+  cxxopts::Options parser("Morphology Check",
+                          "Compares the erosions against a brute force one");
+  // clang-format off
+  parser.allow_unrecognised_options().add_options()
+    ("h,help", "Print help")
+    ("c,cases", "Number of random images to check", cxxopts::value<atg::uinteger>()->default_value("1000"))
+    ("seed", "Random seed", cxxopts::value<atg::uinteger>()->default_value("0"))
+    ;
+  // clang-format on
+  return parser;
+}
+
+constexpr uint8_t k_excluded      = 0xFFu;
+constexpr atg::uinteger k_maxDim  = 96u;
+constexpr atg::uinteger k_maxHalf = 6u;
+
+// The product over the window [x - h, x + h) around every pixel, clipped to
+// the image, computed directly
+std::vector<atg::fpreal> referenceErode(const std::vector<atg::fpreal>& _in,
+                                        const atg::uinteger2 _imageDim,
+                                        const atg::uinteger2 _half)
+{
+  using namespace atg;
+  std::vector<fpreal> out(_in.size());
+  for (uinteger y = 0u; y < _imageDim.y; ++y)
+  {
+    for (uinteger x = 0u; x < _imageDim.x; ++x)
+    {
+      const uinteger top    = y > _half.y ? y - _half.y : 0u;
+      const uinteger left   = x > _half.x ? x - _half.x : 0u;
+      const uinteger bottom = std::min(y + _half.y, _imageDim.y);
+      const uinteger right  = std::min(x + _half.x, _imageDim.x);
+      fpreal product(1.0_f);
+      for (uinteger n = top; n < bottom; ++n)
+        for (uinteger m = left; m < right; ++m)
+          product *= _in[n * _imageDim.x + m];
+      out[y * _imageDim.x + x] = product;
+    }
+  }
+  return out;
+}
+
+// Checks erode on a mask of each label, and against the product of a
+// non-binary image made from the labels
+bool erodeMatches(const std::vector<uint8_t>& _labels,
+                  const atg::uinteger2 _imageDim,
+                  const atg::uinteger2 _half)
+{
+  using namespace atg;
+  const uinteger numPixels = _imageDim.x * _imageDim.y;
+  std::vector<fpreal> image(numPixels);
+  std::vector<fpreal> eroded(numPixels);
+  const auto matches = [&] {
+    erode(image.data(),
+          eroded.data(),
+          _imageDim,
+          _half * 2u + uinteger2(1u),
+          1u);
+    return eroded == referenceErode(image, _imageDim, _half);
+  };
+  for (uinteger label = 0u; label < k_excluded; ++label)
+  {
+    if (std::find(_labels.begin(), _labels.end(), label) == _labels.end())
+      continue;
+    for (uinteger i = 0u; i < numPixels; ++i)
+      image[i] = _labels[i] == label ? 1.0_f : 0.0_f;
+    if (!matches())
+      return false;
+  }
+  for (uinteger i = 0u; i < numPixels; ++i)
+    image[i] = _labels[i] % 2u ? 1.0_f : 0.5_f;
+  return matches();
+}
+
+// Erodes a mask of each label alone, and checks that erodeLabels kept exactly
+// the surviving pixels
+bool erodeLabelsMatches(const std::vector<uint8_t>& _labels,
+                        const atg::uinteger2 _imageDim,
+                        const std::vector<atg::uinteger2>& _kernelHalves,
+                        const std::vector<uint8_t>& _eroded)
+{
+  using namespace atg;
+  const uinteger numPixels = _imageDim.x * _imageDim.y;
+  std::vector<fpreal> mask(numPixels);
+  for (uinteger label = 0u; label < _kernelHalves.size(); ++label)
+  {
+    for (uinteger i = 0u; i < numPixels; ++i)
+      mask[i] = _labels[i] == label ? 1.0_f : 0.0_f;
+
+    // An empty window keeps every pixel, where erodeLabels leaves the label
+    // as it was
+    const auto half     = _kernelHalves[label];
+    const auto expected = half.x && half.y
+                            ? referenceErode(mask, _imageDim, half)
+                            : mask;
+    for (uinteger i = 0u; i < numPixels; ++i)
+    {
+      const bool kept = _eroded[i] == label;
+      if (kept != (expected[i] > 0.0_f))
+        return false;
+    }
+  }
+  // Every other pixel must have been excluded
+  for (uinteger i = 0u; i < numPixels; ++i)
+  {
+    if (_eroded[i] != k_excluded && _eroded[i] != _labels[i])
+      return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[])
+{
+  using namespace atg;
+  // Parse the commandline options
+  auto parser     = getParser();
+  const auto args = parser.parse(argc, argv);
+  if (args.count("help"))
+  {
+    std::cout << parser.help() << '\n';
+    std::exit(0);
+  }
+
+  const uinteger numCases = args["cases"].as<uinteger>();
+  std::mt19937 prng(args["seed"].as<uinteger>());
+  std::uniform_int_distribution<uinteger> dimDist(1u, k_maxDim);
+  std::uniform_int_distribution<uinteger> labelDist(1u, 8u);
+  std::uniform_int_distribution<uinteger> blobDist(1u, 16u);
+  std::uniform_int_distribution<uinteger> halfDist(0u, k_maxHalf);
+
+  uinteger numMismatches = 0u;
+  for (uinteger c = 0u; c < numCases; ++c)
+  {
+    const uinteger2 imageDim{dimDist(prng), dimDist(prng)};
+    const uinteger numLabels = labelDist(prng);
+    const uinteger blob      = blobDist(prng);
+    std::uniform_int_distribution<uinteger> pickLabel(0u, numLabels - 1u);
+    std::uniform_int_distribution<uinteger> noiseDist(0u, 31u);
+
+    // Blocks of labels, with some noise and a few pixels already excluded
+    const uinteger numBlocks = (imageDim.x + blob - 1u) / blob;
+    std::vector<uint8_t> blockLabels(numBlocks * numBlocks);
+    for (auto& label : blockLabels)
+      label = pickLabel(prng);
+    std::vector<uint8_t> labels(imageDim.x * imageDim.y);
+    for (uinteger y = 0u; y < imageDim.y; ++y)
+    {
+      for (uinteger x = 0u; x < imageDim.x; ++x)
+      {
+        auto& label = labels[y * imageDim.x + x];
+        label = blockLabels[((y / blob) % numBlocks) * numBlocks + x / blob];
+        const auto noise = noiseDist(prng);
+        if (!noise)
+          label = pickLabel(prng);
+        else if (noise == 1u)
+          label = k_excluded;
+      }
+    }
+    std::vector<uinteger2> kernelHalves(numLabels);
+    for (auto& half : kernelHalves)
+      half = uinteger2(halfDist(prng), halfDist(prng));
+
+    std::vector<uint8_t> eroded(labels.size());
+    erodeLabels(labels, imageDim, kernelHalves, k_excluded, eroded.data());
+    const bool labelsMatch =
+      erodeLabelsMatches(labels, imageDim, kernelHalves, eroded);
+    const bool erodeMatch = erodeMatches(labels, imageDim, kernelHalves[0]);
+    if (!labelsMatch || !erodeMatch)
+    {
+      std::cout << "Mismatch in case " << c << " from "
+                << (labelsMatch ? "erode" : "erodeLabels") << ", "
+                << imageDim.x << 'x' << imageDim.y << " with " << numLabels
+                << " labels\n";
+      ++numMismatches;
+    }
+  }
+
+  std::cout << numCases << " cases, " << numMismatches << " mismatches\n";
+  return numMismatches ? 1 : 0;
+}
@@ -0,0 +1,18 @@
+include($${PWD}/../common.pri)
+
+TEMPLATE = app
+TARGET = pipeline
+
+UI_HEADERS_DIR = ui
+OBJECTS_DIR = obj
+
+INCLUDEPATH += \
+    $$PWD/../atg/include \
+    $$PWD/include 
+
+LIBS += -L../atg/lib -latg 
+QMAKE_RPATHDIR += ../atg/lib
+
+
+SOURCES += $$files(src/*.cpp, true)
+
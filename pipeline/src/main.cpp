@@ -0,0 +1,195 @@
+#include "image_util.h"
+#include "separation.h"
+#include "specular.h"
+#include "normal.h"
+#include "types.h"
+#include "util.h"
+
+#include <cxxopts.hpp>
+#include <iomanip>
+#include <iostream>
+#include <glm/trigonometric.hpp>
+#include <glm/gtx/fast_square_root.hpp>
+#include <tbb/task_group.h>
+
+namespace
+{
+inline static auto getParser()
+{
+  cxxopts::Options parser("Texture Pipeline",
+                          "Separation, height field and probability maps in "
+                          "a single pass, without intermediate files");
+  // clang-format off
+  parser.allow_unrecognised_options().add_options()
+    ("h,help", "Print help")
+    ("i,input-image", "Source file name", cxxopts::value<std::string>())
+    ("a,albedo-output", "Albedo map output file name",   cxxopts::value<std::string>()->default_value("albedo.png"))
+    ("s,shading-output", "Shading map output file name", cxxopts::value<std::string>()->default_value("shading.png"))
+    ("height-output", "Height map output file name", cxxopts::value<std::string>()->default_value("height_map.png"))
+    ("probability-output", "Probability map output file name, the set index is appended", cxxopts::value<std::string>()->default_value("probability_map.png"))
+    ("r,region", "Region scale", cxxopts::value<atg::uinteger>()->default_value("10"))
+    ("q,quantize-slots", "Chroma quantization slots", cxxopts::value<atg::uinteger>()->default_value("10"))
+    ("e,expectation-iterations", "Intensity seperation iterations", cxxopts::value<atg::uinteger>()->default_value("5"))
+    ("d,direct-iterations", "Direct seperation iterations", cxxopts::value<atg::uinteger>()->default_value("5"))
+    ("t,tolerance", "Stop iterating once the largest per pixel change falls below this", cxxopts::value<atg::fpreal>()->default_value("0"))
+    ("l,levels", "Number of pyramid levels for coarse to fine separation", cxxopts::value<atg::uinteger>()->default_value("1"))
+    ("refine-iterations", "Expectation iterations at each pyramid level above the coarsest", cxxopts::value<atg::uinteger>()->default_value("2"))
+    ("w,sliding-window", "Incrementally update region histograms, O(R) rather than O(R^2) per region", cxxopts::value<bool>())
+    ("azimuth", "Azimuthal angle of lighting direction", cxxopts::value<atg::fpreal>()->default_value("45"))
+    ("polar", "Polar angle of lighting direction", cxxopts::value<atg::fpreal>()->default_value("45"))
+    ("n,normal-iterations", "Maximum relative normal iterations", cxxopts::value<atg::uinteger>()->default_value("25"))
+    ("normal-tolerance", "Stop iterating once no normal moves further than this", cxxopts::value<atg::fpreal>()->default_value("0"))
+    ("height-solver", "Absolute height solver, jacobi or multigrid", cxxopts::value<std::string>()->default_value("jacobi"))
+    ("height-tolerance", "Relative residual at which the multigrid height solver stops", cxxopts::value<atg::fpreal>()->default_value("1e-4"))
+    ("sets", "Number of material sets that exhibit distinct specular properties", cxxopts::value<atg::uinteger>())
+    ("kmeans", "Clustering algorithm for the material sets, lloyd or hamerly", cxxopts::value<std::string>()->default_value("lloyd"))
+    ("kmeans-samples", "Find the material set means from this many sampled pixels, 0 uses every pixel", cxxopts::value<atg::uinteger>()->default_value("0"))
+    ;
+  // clang-format on
+  return parser;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[])
+{
+  using namespace atg;
+  // Parse the commandline options
+  auto parser     = getParser();
+  const auto args = parser.parse(argc, argv);
+  if (args.count("help") || !args.count("input-image") || !args.count("sets"))
+  {
+    std::cout << parser.help() << '\n';
+    std::exit(0);
+  }
+  const auto solverName = args["height-solver"].as<std::string>();
+  if (solverName != "jacobi" && solverName != "multigrid")
+  {
+    std::cout << "Unknown height solver: " << solverName << '\n';
+    std::exit(1);
+  }
+  const auto solver = solverName == "multigrid" ? HeightSolver::MULTIGRID
+                                                : HeightSolver::JACOBI;
+  const auto kmeansName = args["kmeans"].as<std::string>();
+  if (kmeansName != "lloyd" && kmeansName != "hamerly")
+  {
+    std::cout << "Unknown clustering algorithm: " << kmeansName << '\n';
+    std::exit(1);
+  }
+  const auto kmeans = kmeansName == "hamerly" ? KMeansAlgorithm::HAMERLY
+                                              : KMeansAlgorithm::LLOYD;
+  if (args["quantize-slots"].as<uinteger>() > MAX_CHROMA_SLOTS)
+  {
+    std::cout << "Too many quantization slots: "
+              << args["quantize-slots"].as<uinteger>() << '\n';
+    std::exit(1);
+  }
+  if (args["sets"].as<uinteger>() > MaterialSets::EXCLUDED)
+  {
+    std::cout << "Too many material sets: " << args["sets"].as<uinteger>()
+              << '\n';
+    std::exit(1);
+  }
+
+  // Read the source image in as an array of rgbf
+  auto imgResult =
+    readImage<fpreal3>(args["input-image"].as<std::string>());
+  auto&& sourceImageData = imgResult.m_data;
+  auto&& imageDimensions = imgResult.m_imageDim;
+  auto numPixels         = imageDimensions.x * imageDimensions.y;
+  auto sourceImage       = makeSpan(sourceImageData, numPixels);
+
+  // Allocated arrays to store the resulting textures
+  auto albedo           = std::make_unique<fpreal3[]>(numPixels);
+  auto shadingIntensity = std::make_unique<fpreal[]>(numPixels);
+
+  // Split out the albedo and shading from the source image
+  seperateShadingPyramid(sourceImage,
+                         albedo.get(),
+                         shadingIntensity.get(),
+                         imageDimensions,
+                         args["region"].as<uinteger>(),
+                         args["direct-iterations"].as<uinteger>(),
+                         args["expectation-iterations"].as<uinteger>(),
+                         args["quantize-slots"].as<uinteger>(),
+                         args["sliding-window"].as<bool>(),
+                         args["tolerance"].as<fpreal>(),
+                         args["levels"].as<uinteger>(),
+                         args["refine-iterations"].as<uinteger>());
+
+  // The later stages clamp their inputs, so take copies of the full precision
+  // planes for them rather than round tripping through 8 bit files
+  std::vector<fpreal> shadingMap(shadingIntensity.get(),
+                                 shadingIntensity.get() + numPixels);
+  std::vector<fpreal3> albedoMap(albedo.get(), albedo.get() + numPixels);
+
+  // Every output is encoded in the background as soon as it is ready
+  AsyncImageWriter writer;
+  writer.enqueue(args["albedo-output"].as<std::string>(),
+                 std::move(albedo),
+                 imageDimensions);
+  writer.enqueue(args["shading-output"].as<std::string>(),
+                 std::move(shadingIntensity),
+                 imageDimensions);
+
+  // The height field and probability maps only depend on the separation, so
+  // run them concurrently
+  tbb::task_group stages;
+
+  stages.run([&] {
+    // Obtain spherical coordinates, r is assumed to be 1 as this is a
+    // direction
+    auto azimuth = glm::radians(args["azimuth"].as<fpreal>());
+    auto polar   = glm::radians(args["polar"].as<fpreal>());
+    // Compute cartesian direction vector from our spherical coordinates
+    fpreal3 L = {glm::sin(polar) * glm::cos(azimuth),
+                 glm::sin(polar) * glm::sin(azimuth),
+                 glm::cos(polar)};
+    L = glm::fastNormalize(L);
+
+    auto shadingImage = makeSpan(shadingMap.data(), numPixels);
+    clampExtremeties(shadingImage);
+    auto normals = computeRelativeNormals(
+      shadingImage,
+      L,
+      args["normal-iterations"].as<uinteger>(),
+      args["normal-tolerance"].as<fpreal>());
+    auto rh = computeRelativeHeights(normals.data(), imageDimensions);
+    auto h  = computeAbsoluteHeights(rh.data(),
+                                    imageDimensions,
+                                    solver,
+                                    args["height-tolerance"].as<fpreal>());
+    writer.enqueue(
+      args["height-output"].as<std::string>(), std::move(h), imageDimensions);
+  });
+
+  stages.run([&] {
+    auto albedoImage = makeSpan(albedoMap.data(), numPixels);
+    clampExtremeties(albedoImage);
+
+    const uinteger numSets = args["sets"].as<uinteger>();
+    auto materialSets =
+      initMaterialSets(albedoImage,
+                       imageDimensions,
+                       numSets,
+                       kmeans,
+                       args["kmeans-samples"].as<uinteger>());
+    removeOutliers(materialSets, albedoImage);
+    auto probabilities = computeProbability(materialSets, albedoImage);
+
+    auto outName       = args["probability-output"].as<std::string>();
+    auto extPos        = outName.find('.');
+    std::string prefix = outName.substr(0, extPos);
+    std::string ext    = outName.substr(extPos, outName.size());
+    for (uinteger i = 0u; i < numSets; ++i)
+    {
+      writer.enqueue(prefix + std::to_string(i) + ext,
+                     std::move(probabilities[i]),
+                     imageDimensions);
+    }
+  });
+  stages.wait();
+  writer.flush();
+
+  return 0;
+}
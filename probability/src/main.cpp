@@ -23,6 +23,8 @@ inline static auto getParser()
     ("i,input-image", "Source file name", cxxopts::value<std::string>()) 
     ("o,output", "Output file name",    cxxopts::value<std::string>()->default_value("probability_map.png")) 
     ("s,sets", "Number of material sets that exhibit distinct specular properties", cxxopts::value<atg::uinteger>())
+    ("kmeans", "Clustering algorithm for the material sets, lloyd or hamerly", cxxopts::value<std::string>()->default_value("lloyd"))
+    ("kmeans-samples", "Find the material set means from this many sampled pixels, 0 uses every pixel", cxxopts::value<atg::uinteger>()->default_value("0"))
     ;
   // clang-format on
   return parser;
@@ -41,6 +43,20 @@ int main(int argc, char* argv[])
     std::cout << parser.help() << '\n';
     std::exit(0);
   }
+  const auto kmeansName = args["kmeans"].as<std::string>();
+  if (kmeansName != "lloyd" && kmeansName != "hamerly")
+  {
+    std::cout << "Unknown clustering algorithm: " << kmeansName << '\n';
+    std::exit(1);
+  }
+  const auto kmeans = kmeansName == "hamerly" ? KMeansAlgorithm::HAMERLY
+                                              : KMeansAlgorithm::LLOYD;
+  if (args["sets"].as<uinteger>() > MaterialSets::EXCLUDED)
+  {
+    std::cout << "Too many material sets: " << args["sets"].as<uinteger>()
+              << '\n';
+    std::exit(1);
+  }
 
   // Read the source image in as an array of rgbf
   auto imgResult =
@@ -55,7 +71,12 @@ int main(int argc, char* argv[])
 
   const uint numSets = args["sets"].as<uinteger>();
 
-  auto materialSets = initMaterialSets(sourceImage, imageDimensions, numSets);
+  auto materialSets =
+    initMaterialSets(sourceImage,
+                     imageDimensions,
+                     numSets,
+                     kmeans,
+                     args["kmeans-samples"].as<uinteger>());
   removeOutliers(materialSets, sourceImage);
   auto probabilities = computeProbability(materialSets, sourceImage);
 
@@ -63,12 +84,15 @@ int main(int argc, char* argv[])
   auto extPos = outName.find('.');
   std::string prefix = outName.substr(0, extPos);
   std::string ext = outName.substr(extPos, outName.size());
+  // Encode the maps in the background, several at a time
+  AsyncImageWriter writer;
   for (uint i = 0u; i < numSets; ++i)
   {
-    writeImage(prefix + std::to_string(i) + ext,
-               probabilities[i].data(),
-               imageDimensions);
+    writer.enqueue(prefix + std::to_string(i) + ext,
+                   std::move(probabilities[i]),
+                   imageDimensions);
   }
+  writer.flush();
 
   //auto img = std::make_unique<fpreal[]>(numPixels);
   //for (uint i = 0u; i < numSets; ++i)
@@ -0,0 +1,222 @@
+#include "region.h"
+#include "separation.h"
+#include "types.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cxxopts.hpp>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <tbb/blocked_range.h>
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/parallel_for.h>
+#include <tbb/task_arena.h>
+#include <vector>
+
+namespace
+{
+inline static auto getParser()
+{
+  cxxopts::Options parser("Region Benchmark",
+                          "Times the region traversal orders on one image");
+  // clang-format off
+  parser.allow_unrecognised_options().add_options()
+    ("h,help", "Print help")
+    ("width", "Image width",   cxxopts::value<atg::uinteger>()->default_value("3840"))
+    ("height", "Image height", cxxopts::value<atg::uinteger>()->default_value("2160"))
+    ("r,region", "Region scale", cxxopts::value<atg::uinteger>()->default_value("10"))
+    ("s,slots", "Number of chroma ids", cxxopts::value<atg::uinteger>()->default_value("100"))
+    ("repeats", "Keep the fastest of this many runs", cxxopts::value<atg::uinteger>()->default_value("5"))
+    ("t,threads", "Threads for the parallel runs, 0 uses every core", cxxopts::value<atg::uinteger>()->default_value("0"))
+    ;
+  // clang-format on
+  return parser;
+}
+
+struct Planes
+{
+  std::vector<atg::fpreal> m_intensity;
+  std::vector<atg::fpreal> m_albedoIntensity;
+  std::vector<atg::ChromaId> m_chromaIds;
+  atg::uinteger m_numIds;
+};
+
+// The per pixel work of estimateAlbedoIntensities, a histogram of intensity
+// per chroma id and the summed shading
+template <typename Walk>
+atg::fpreal walkRegion(const Planes& _planes,
+                       const atg::uinteger _pixel,
+                       std::vector<atg::fpreal>& io_histogram,
+                       Walk&& _walk)
+{
+  using namespace atg;
+  fpreal shadingSum(0.0_f);
+  _walk([&](const uinteger _pixelIndex) {
+    io_histogram[_planes.m_chromaIds[_pixelIndex]] +=
+      _planes.m_intensity[_pixelIndex];
+    shadingSum +=
+      _planes.m_intensity[_pixelIndex] / _planes.m_albedoIntensity[_pixelIndex];
+  });
+  auto result = shadingSum + io_histogram[_planes.m_chromaIds[_pixel]];
+  std::fill(io_histogram.begin(), io_histogram.end(), 0.0_f);
+  return result;
+}
+
+// Estimates every region, one row of regions at a time as separate does,
+// returning the seconds taken by the fastest of the repeats
+template <typename Estimate>
+double timeRegions(tbb::task_arena& _arena,
+                   const atg::RegionData& _regions,
+                   const atg::uinteger _grain,
+                   const atg::uinteger _repeats,
+                   std::vector<atg::fpreal>& o_results,
+                   Estimate&& _estimate)
+{
+  using namespace atg;
+  const auto numRegionsXY = _regions.m_numRegions;
+  double best             = std::numeric_limits<double>::max();
+  for (uinteger repeat = 0u; repeat < _repeats; ++repeat)
+  {
+    const auto start = std::chrono::steady_clock::now();
+    _arena.execute([&] {
+      for (uinteger regionRow = 0u; regionRow < numRegionsXY.y; ++regionRow)
+      {
+        tbb::parallel_for(
+          tbb::blocked_range<uinteger>{0u, numRegionsXY.x, _grain},
+          [&](auto&& r) {
+            const auto end = r.end();
+            for (auto x = r.begin(); x < end; ++x)
+            {
+              const auto region = regionRow * numRegionsXY.x + x;
+              o_results[region] = _estimate(_regions.m_regions[region]);
+            }
+          });
+      }
+    });
+    const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+    best = std::min(best, elapsed.count());
+  }
+  return best;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[])
+{
+  using namespace atg;
+  // Parse the commandline options
+  auto parser     = getParser();
+  const auto args = parser.parse(argc, argv);
+  if (args.count("help"))
+  {
+    std::cout << parser.help() << '\n';
+    std::exit(0);
+  }
+  const uinteger2 imageDim{args["width"].as<uinteger>(),
+                           args["height"].as<uinteger>()};
+  const uinteger regionScale = args["region"].as<uinteger>();
+  const uinteger repeats     = args["repeats"].as<uinteger>();
+  if (!regionScale || regionScale > imageDim.x || regionScale > imageDim.y)
+  {
+    std::cout << "Invalid region scale: " << regionScale << '\n';
+    std::exit(1);
+  }
+
+  // Fill the planes with reproducible noise
+  const uinteger numPixels = imageDim.x * imageDim.y;
+  Planes planes;
+  planes.m_numIds = args["slots"].as<uinteger>();
+  planes.m_intensity.resize(numPixels);
+  planes.m_albedoIntensity.resize(numPixels);
+  planes.m_chromaIds.resize(numPixels);
+  std::mt19937 prng(0u);
+  std::uniform_real_distribution<fpreal> intensityDist(0.1_f, 1.0_f);
+  std::uniform_int_distribution<uinteger> idDist(0u, planes.m_numIds - 1u);
+  for (uinteger i = 0u; i < numPixels; ++i)
+  {
+    planes.m_intensity[i]       = intensityDist(prng);
+    planes.m_albedoIntensity[i] = intensityDist(prng);
+    planes.m_chromaIds[i]       = idDist(prng);
+  }
+
+  const auto regions      = generateRegions(imageDim, regionScale);
+  const auto numRegionsXY = regions.m_numRegions;
+  tbb::enumerable_thread_specific<std::vector<fpreal>> histograms(
+    planes.m_numIds, 0.0_f);
+
+  // The traversal used before the iterators were made row major, which
+  // strides a full image row between consecutive pixels
+  const auto columnMajor = [&](const Region _region) {
+    return walkRegion(
+      planes,
+      _region.y * imageDim.x + _region.x,
+      histograms.local(),
+      [&](auto&& _func) {
+        for (uinteger x = 0u; x < regionScale; ++x)
+          for (uinteger y = 0u; y < regionScale; ++y)
+            _func((_region.y + y) * imageDim.x + _region.x + x);
+      });
+  };
+  const auto rowMajor = [&](const Region _region) {
+    return walkRegion(
+      planes,
+      _region.y * imageDim.x + _region.x,
+      histograms.local(),
+      [&](auto&& _func) {
+        for_each_local_pixel(
+          [&](auto pixel, auto) { _func(pixel); },
+          _region,
+          imageDim,
+          regionScale);
+      });
+  };
+
+  const uinteger numThreads =
+    args["threads"].as<uinteger>()
+      ? args["threads"].as<uinteger>()
+      : uinteger(tbb::this_task_arena::max_concurrency());
+  tbb::task_arena serial(1);
+  tbb::task_arena parallel(numThreads);
+
+  // Separation hands out blocks of 4R adjacent regions, the old scheduling
+  // left the grain to the partitioner
+  const uinteger blockGrain = 4u * regionScale;
+  std::vector<fpreal> reference(numRegionsXY.x * numRegionsXY.y);
+  std::vector<fpreal> results(reference.size());
+  const double columnTimes[] = {
+    timeRegions(serial, regions, 1u, repeats, reference, columnMajor),
+    timeRegions(parallel, regions, 1u, repeats, reference, columnMajor)};
+  const double rowTimes[] = {
+    timeRegions(serial, regions, 1u, repeats, results, rowMajor),
+    timeRegions(parallel, regions, 1u, repeats, results, rowMajor)};
+  const double blockTimes[] = {
+    timeRegions(serial, regions, blockGrain, repeats, results, rowMajor),
+    timeRegions(parallel, regions, blockGrain, repeats, results, rowMajor)};
+
+  // Only the summation order differs between the walks
+  fpreal maxDifference(0.0_f);
+  for (uinteger i = 0u; i < reference.size(); ++i)
+  {
+    maxDifference =
+      std::max(maxDifference, std::abs(reference[i] - results[i]));
+  }
+
+  const auto printTimes = [&](const char* _name, const double* _times) {
+    std::cout << _name << _times[0] * 1000.0 << "ms on 1 thread, "
+              << _times[1] * 1000.0 << "ms on " << numThreads << ", "
+              << _times[0] / _times[1] << "x\n";
+  };
+  std::cout << imageDim.x << 'x' << imageDim.y << ", region scale "
+            << regionScale << ", "
+            << (numRegionsXY.x + blockGrain - 1u) / blockGrain
+            << " blocks of 4R per row of regions\n";
+  printTimes("column major:           ", columnTimes);
+  printTimes("row major:              ", rowTimes);
+  printTimes("row major, 4R grain:    ", blockTimes);
+  std::cout << "max difference:         " << maxDifference << '\n';
+
+  return 0;
+}
@@ -27,6 +27,11 @@ inline static auto getParser()
     ("q,quantize-slots", "Chroma quantization slots", cxxopts::value<atg::uinteger>()->default_value("10"))
     ("e,expectation-iterations", "Intensity seperation iterations", cxxopts::value<atg::uinteger>()->default_value("5"))
     ("d,direct-iterations", "Direct seperation iterations", cxxopts::value<atg::uinteger>()->default_value("5"))
+    ("t,tolerance", "Stop iterating once the largest per pixel change falls below this", cxxopts::value<atg::fpreal>()->default_value("0"))
+    ("l,levels", "Number of pyramid levels for coarse to fine separation", cxxopts::value<atg::uinteger>()->default_value("1"))
+    ("refine-iterations", "Expectation iterations at each pyramid level above the coarsest", cxxopts::value<atg::uinteger>()->default_value("2"))
+    ("tile-size", "Stream from disk, separating tiles of this size at a single pyramid level", cxxopts::value<atg::uinteger>()->default_value("0"))
+    ("w,sliding-window", "Incrementally update region histograms, O(R) rather than O(R^2) per region", cxxopts::value<bool>())
     ;
   // clang-format on
   return parser;
@@ -45,6 +50,34 @@ int main(int argc, char* argv[])
     std::cout << parser.help() << '\n';
     std::exit(0);
   }
+  if (args["quantize-slots"].as<uinteger>() > MAX_CHROMA_SLOTS)
+  {
+    std::cout << "Too many quantization slots: "
+              << args["quantize-slots"].as<uinteger>() << '\n';
+    std::exit(1);
+  }
+  // Tiles are separated independently at full resolution only
+  if (args["tile-size"].as<uinteger>() &&
+      (args["levels"].as<uinteger>() > 1u || args.count("refine-iterations")))
+  {
+    std::cout << "Tiled separation does not support pyramid levels\n";
+    std::exit(1);
+  }
+
+  if (args["tile-size"].as<uinteger>())
+  {
+    seperateShadingTiled(args["input-image"].as<std::string>(),
+                         args["albedo-output"].as<std::string>(),
+                         args["shading-output"].as<std::string>(),
+                         args["tile-size"].as<uinteger>(),
+                         args["region"].as<uinteger>(),
+                         args["direct-iterations"].as<uinteger>(),
+                         args["expectation-iterations"].as<uinteger>(),
+                         args["quantize-slots"].as<uinteger>(),
+                         args["sliding-window"].as<bool>(),
+                         args["tolerance"].as<fpreal>());
+    return 0;
+  }
 
   // Read the source image in as an array of rgbf
   auto imgResult =
@@ -54,32 +87,36 @@ int main(int argc, char* argv[])
   auto numPixels         = imageDimensions.x * imageDimensions.y;
   auto sourceImage       = makeSpan(sourceImageData, numPixels);
 
-  // Remove the extreme highlights and shadows by clamping intense pixels
-  clampExtremeties(sourceImage);
-
+  // Extreme highlights and shadows are clamped as part of the separation
   // Allocated arrays to store the resulting textures
   auto albedo           = std::make_unique<fpreal3[]>(numPixels);
   auto shadingIntensity = std::make_unique<fpreal[]>(numPixels);
 
   // Split out the albedo and shading from the source image
-  seperateShading(sourceImage,
-                  albedo.get(),
-                  shadingIntensity.get(),
-                  imageDimensions,
-                  args["region"].as<uinteger>(),
-                  args["direct-iterations"].as<uinteger>(),
-                  args["expectation-iterations"].as<uinteger>(),
-                  args["quantize-slots"].as<uinteger>());
+  seperateShadingPyramid(sourceImage,
+                         albedo.get(),
+                         shadingIntensity.get(),
+                         imageDimensions,
+                         args["region"].as<uinteger>(),
+                         args["direct-iterations"].as<uinteger>(),
+                         args["expectation-iterations"].as<uinteger>(),
+                         args["quantize-slots"].as<uinteger>(),
+                         args["sliding-window"].as<bool>(),
+                         args["tolerance"].as<fpreal>(),
+                         args["levels"].as<uinteger>(),
+                         args["refine-iterations"].as<uinteger>());
 
-  writeImage(args["albedo-output"].as<std::string>(),
-                  albedo.get(),
-                  imageDimensions);
+  // Encode both maps concurrently
+  AsyncImageWriter writer;
+  writer.enqueue(args["albedo-output"].as<std::string>(),
+                 std::move(albedo),
+                 imageDimensions);
   // Shading map should be adjusted to use a 0.5 neutral rather than 1.0,
   // for easier viewing
-  writeImage(args["shading-output"].as<std::string>(),
-                  shadingIntensity.get(),
-                  imageDimensions);
-
+  writer.enqueue(args["shading-output"].as<std::string>(),
+                 std::move(shadingIntensity),
+                 imageDimensions);
+  writer.flush();
 
   return 0;
 }